@@ -0,0 +1,481 @@
+#ifndef AUDIO_FORMAT_H
+#define AUDIO_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIO_FORMAT_X86  1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_FORMAT_NEON  1
+#endif
+
+/* Device request with AUDIO_NATIVE=0: what the players always asked for */
+#define AUDIO_FORMAT_RATE      44100
+#define AUDIO_FORMAT_CHANNELS  2
+
+
+/* How decoded frames reach the device */
+enum {
+    AUDIO_FORMAT_COPY,        /* already the device's layout: no copy */
+    AUDIO_FORMAT_INTERLEAVE,  /* planar to packed, same samples */
+    AUDIO_FORMAT_RESAMPLE     /* rate, sample type or layout differ: swr */
+};
+
+static const char *audio_format_modes[] = { "copy", "interleave", "swr" };
+
+/*
+ * Decoded audio into the device's format, doing as little as the two
+ * allow. The device is asked for the source's own rate, sample type and
+ * channel count, and SDL is allowed to open whatever the hardware has
+ * instead, so SDL never converts a second time behind the player:
+ *   AUDIO_NATIVE=0  ask for S16 stereo at 44.1 kHz and let SDL convert
+ *                   that to the hardware, as before
+ * When the device took the source's format, frames go to the ring as
+ * they are; float-planar (AAC and most lossy decoders) is interleaved by
+ * a SIMD kernel; only a real change of rate, type or layout goes through
+ * swr. A source that changes format mid-stream renegotiates.
+ */
+typedef struct {
+    int rate;
+    int channels;
+    int frame_size;
+    int bytes_per_second;
+    enum AVSampleFormat format;
+    int in_rate;
+    int in_channels;
+    Uint64 in_layout;
+    enum AVSampleFormat in_format;
+    int mode;
+    SwrContext *swr;
+    void (*interleave)(const Uint8 *const *src, Uint8 *dst, int samples,
+        int channels, int bytes);
+    const char *kernel;
+    Uint8 *buffer;
+    int buffer_size;
+} AudioFormat;
+
+static int audio_format_native(void)
+{
+    const char *env = getenv("AUDIO_NATIVE");
+
+    return !env || atoi(env) != 0;
+}
+
+/* SDL_OpenAudioDevice's allowed_changes: the buffer size is left to the
+ * player */
+static int audio_format_changes(void)
+{
+    return audio_format_native() ? SDL_AUDIO_ALLOW_FREQUENCY_CHANGE |
+        SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE : 0;
+}
+
+/* SDL's format for the packed form of 'format'; double has no SDL
+ * equivalent and goes to float */
+static SDL_AudioFormat audio_format_to_sdl(enum AVSampleFormat format)
+{
+    switch (av_get_packed_sample_fmt(format)) {
+    case AV_SAMPLE_FMT_U8:
+        return AUDIO_U8;
+    case AV_SAMPLE_FMT_S16:
+        return AUDIO_S16SYS;
+    case AV_SAMPLE_FMT_S32:
+        return AUDIO_S32SYS;
+    default:
+        return AUDIO_F32SYS;
+    }
+}
+
+/* Packed FFmpeg format for what the device opened with, or NONE */
+static enum AVSampleFormat audio_format_from_sdl(SDL_AudioFormat format)
+{
+    switch (format) {
+    case AUDIO_U8:
+        return AV_SAMPLE_FMT_U8;
+    case AUDIO_S16SYS:
+        return AV_SAMPLE_FMT_S16;
+    case AUDIO_S32SYS:
+        return AV_SAMPLE_FMT_S32;
+    case AUDIO_F32SYS:
+        return AV_SAMPLE_FMT_FLT;
+    default:
+        return AV_SAMPLE_FMT_NONE;
+    }
+}
+
+/* Planar to packed for any sample size, one sample at a time */
+static void audio_format_interleave_scalar(const Uint8 *const *src,
+    Uint8 *dst, int samples, int channels, int bytes)
+{
+    for (int i = 0; i < samples; i++) {
+        for (int c = 0; c < channels; c++) {
+            SDL_memcpy(dst, src[c] + (size_t)i * bytes, bytes);
+            dst += bytes;
+        }
+    }
+}
+
+/* Two planes of 32-bit samples (float or int, the bits only move) */
+static void audio_format_interleave2_tail(const Uint32 *l, const Uint32 *r,
+    Uint32 *dst, int from, int samples)
+{
+    for (int i = from; i < samples; i++) {
+        dst[2 * i] = l[i];
+        dst[2 * i + 1] = r[i];
+    }
+}
+
+static void audio_format_interleave2_scalar(const Uint8 *const *src,
+    Uint8 *dst, int samples, int channels, int bytes)
+{
+    audio_format_interleave2_tail((const Uint32 *)src[0],
+        (const Uint32 *)src[1], (Uint32 *)dst, 0, samples);
+}
+
+#ifdef AUDIO_FORMAT_X86
+
+/* Four samples per plane per step */
+__attribute__((target("sse2")))
+static void audio_format_interleave2_sse2(const Uint8 *const *src,
+    Uint8 *dst, int samples, int channels, int bytes)
+{
+    const float *l = (const float *)src[0];
+    const float *r = (const float *)src[1];
+    float *out = (float *)dst;
+    int i = 0;
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128 a = _mm_loadu_ps(l + i);
+        __m128 b = _mm_loadu_ps(r + i);
+
+        _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(a, b));
+    }
+
+    audio_format_interleave2_tail((const Uint32 *)l, (const Uint32 *)r,
+        (Uint32 *)dst, i, samples);
+}
+
+#endif
+
+#ifdef AUDIO_FORMAT_NEON
+
+static void audio_format_interleave2_neon(const Uint8 *const *src,
+    Uint8 *dst, int samples, int channels, int bytes)
+{
+    const float *l = (const float *)src[0];
+    const float *r = (const float *)src[1];
+    float *out = (float *)dst;
+    int i = 0;
+
+    for (; i + 4 <= samples; i += 4) {
+        float32x4x2_t v;
+
+        v.val[0] = vld1q_f32(l + i);
+        v.val[1] = vld1q_f32(r + i);
+        vst2q_f32(out + 2 * i, v);
+    }
+
+    audio_format_interleave2_tail((const Uint32 *)l, (const Uint32 *)r,
+        (Uint32 *)dst, i, samples);
+}
+
+#endif
+
+/* Stereo 32-bit planes get the fastest kernel this CPU runs */
+static void audio_format_pick(AudioFormat *af)
+{
+    int bytes = av_get_bytes_per_sample(af->format);
+
+    af->interleave = audio_format_interleave_scalar;
+    af->kernel = "scalar";
+
+    if (af->channels != 2 || bytes != 4) {
+        return;
+    }
+    else {
+        af->interleave = audio_format_interleave2_scalar;
+    }
+
+#ifdef AUDIO_FORMAT_X86
+    if (SDL_HasSSE2()) {
+        af->interleave = audio_format_interleave2_sse2;
+        af->kernel = "sse2";
+    }
+    else {
+        /* nothing */
+    }
+#endif
+
+#ifdef AUDIO_FORMAT_NEON
+    if (SDL_HasNEON()) {
+        af->interleave = audio_format_interleave2_neon;
+        af->kernel = "neon";
+    }
+    else {
+        /* nothing */
+    }
+#endif
+}
+
+/* Device request for a source of 'codec_ctx'; the player fills in the
+ * buffer size, callback and userdata */
+static void audio_format_request(SDL_AudioSpec *spec,
+    const AVCodecContext *codec_ctx)
+{
+    SDL_memset(spec, 0, sizeof(*spec));
+
+    if (audio_format_native() && codec_ctx->sample_rate > 0 &&
+        codec_ctx->channels > 0) {
+        spec->freq = codec_ctx->sample_rate;
+        spec->format = audio_format_to_sdl(codec_ctx->sample_fmt);
+        spec->channels = codec_ctx->channels;
+    }
+    else {
+        spec->freq = AUDIO_FORMAT_RATE;
+        spec->format = AUDIO_S16SYS;
+        spec->channels = AUDIO_FORMAT_CHANNELS;
+    }
+}
+
+/* Open the default device for 'spec' (callback and all). A device that
+ * hands back a sample format with no packed FFmpeg match here (S16MSB,
+ * U16, S8) is reopened at S16SYS with SDL converting to it, so it plays
+ * as it did before native formats; 0 if neither open works */
+static SDL_AudioDeviceID audio_format_open(SDL_AudioSpec *spec,
+    SDL_AudioSpec *have)
+{
+    SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, spec, have,
+        audio_format_changes());
+
+    if (!dev || audio_format_from_sdl(have->format) != AV_SAMPLE_FMT_NONE) {
+        return dev;
+    }
+    else {
+        printf("Audio device format 0x%x unsupported, asking for S16\n",
+            have->format);
+        SDL_CloseAudioDevice(dev);
+    }
+
+    spec->format = AUDIO_S16SYS;
+
+    return SDL_OpenAudioDevice(NULL, 0, spec, have,
+        audio_format_changes() & ~SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+}
+
+/* Choose how frames of this source reach the device, (re)building the
+ * resampler only when it is needed */
+static int audio_format_source(AudioFormat *af, enum AVSampleFormat format,
+    int rate, int channels, Uint64 layout)
+{
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    int planar = av_sample_fmt_is_planar(format) && channels > 1;
+    int same = rate == af->rate && channels == af->channels &&
+        packed == af->format;
+
+    af->in_format = format;
+    af->in_rate = rate;
+    af->in_channels = channels;
+    af->in_layout = layout;
+
+    if (af->swr) {
+        swr_free(&af->swr);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (layout == 0) {
+        layout = (Uint64)av_get_default_channel_layout(channels);
+    }
+    else {
+        /* nothing */
+    }
+
+    /* SDL takes more than two channels in FFmpeg's default order only */
+    if (channels > 2 &&
+        layout != (Uint64)av_get_default_channel_layout(channels)) {
+        same = 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (same) {
+        af->mode = planar ? AUDIO_FORMAT_INTERLEAVE : AUDIO_FORMAT_COPY;
+        return 0;
+    }
+    else {
+        af->mode = AUDIO_FORMAT_RESAMPLE;
+    }
+
+    af->swr = swr_alloc_set_opts(NULL,
+        av_get_default_channel_layout(af->channels), af->format, af->rate,
+        (int64_t)layout, format, rate, 0, NULL);
+    if (!af->swr || swr_init(af->swr) < 0) {
+        fprintf(stderr, "Could not init resampler\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* 'have' is what the device opened with for 'codec_ctx' */
+static int audio_format_init(AudioFormat *af, const SDL_AudioSpec *have,
+    const AVCodecContext *codec_ctx)
+{
+    SDL_memset(af, 0, sizeof(*af));
+    af->rate = have->freq;
+    af->channels = have->channels;
+    af->format = audio_format_from_sdl(have->format);
+    if (af->format == AV_SAMPLE_FMT_NONE) {
+        fprintf(stderr, "Unsupported audio device format 0x%x\n",
+            have->format);
+        return -1;
+    }
+    else {
+        af->frame_size = av_get_bytes_per_sample(af->format) * af->channels;
+        af->bytes_per_second = af->rate * af->frame_size;
+    }
+
+    audio_format_pick(af);
+
+    if (audio_format_source(af, codec_ctx->sample_fmt,
+            codec_ctx->sample_rate, codec_ctx->channels,
+            codec_ctx->channel_layout) < 0) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    printf("Audio format: %s %d Hz %d ch -> device %s %d Hz %d ch "
+        "(%s%s%s)\n", av_get_sample_fmt_name(af->in_format), af->in_rate,
+        af->in_channels, av_get_sample_fmt_name(af->format), af->rate,
+        af->channels, audio_format_modes[af->mode],
+        af->mode == AUDIO_FORMAT_INTERLEAVE ? ", " : "",
+        af->mode == AUDIO_FORMAT_INTERLEAVE ? af->kernel : "");
+
+    return 0;
+}
+
+static int audio_format_reserve(AudioFormat *af, int size)
+{
+    if (size > af->buffer_size) {
+        free(af->buffer);
+        af->buffer = malloc(size);
+        af->buffer_size = af->buffer ? size : 0;
+    }
+    else {
+        /* buffer is big enough */
+    }
+
+    return af->buffer ? 0 : -1;
+}
+
+/*
+ * Device-format bytes for 'frame' at *out, valid until the next call:
+ * the frame's own data when nothing needs doing, otherwise af->buffer.
+ * Returns the byte count, 0 when the resampler is still filling up, or
+ * -1 on error.
+ */
+static int audio_format_convert(AudioFormat *af, AVFrame *frame,
+    const Uint8 **out)
+{
+    int samples = frame->nb_samples;
+
+    if (frame->format != af->in_format ||
+        frame->sample_rate != af->in_rate ||
+        frame->channels != af->in_channels) {
+        if (audio_format_source(af, frame->format, frame->sample_rate,
+                frame->channels, frame->channel_layout) < 0) {
+            return -1;
+        }
+        else {
+            printf("Audio format: source changed to %s %d Hz %d ch (%s)\n",
+                av_get_sample_fmt_name(af->in_format), af->in_rate,
+                af->in_channels, audio_format_modes[af->mode]);
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    if (af->mode == AUDIO_FORMAT_COPY) {
+        *out = frame->data[0];
+        return samples * af->frame_size;
+    }
+    else if (af->mode == AUDIO_FORMAT_INTERLEAVE) {
+        if (audio_format_reserve(af, samples * af->frame_size) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+
+        af->interleave((const Uint8 *const *)frame->extended_data,
+            af->buffer, samples, af->channels,
+            av_get_bytes_per_sample(af->format));
+        *out = af->buffer;
+        return samples * af->frame_size;
+    }
+    else {
+        int out_samples = swr_get_out_samples(af->swr, samples);
+        int converted;
+
+        if (audio_format_reserve(af, out_samples * af->frame_size) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+
+        converted = swr_convert(af->swr, &af->buffer, out_samples,
+            (const uint8_t **)frame->extended_data, samples);
+        *out = af->buffer;
+        return converted > 0 ? converted * af->frame_size : converted;
+    }
+}
+
+/* Seconds of input held inside the resampler, not yet output */
+static double audio_format_delay(AudioFormat *af)
+{
+    return af->swr ?
+        (double)swr_get_delay(af->swr, af->rate) / af->rate : 0.0;
+}
+
+/* Drop what the resampler holds, e.g. after a seek */
+static void audio_format_reset(AudioFormat *af)
+{
+    if (af->swr) {
+        swr_init(af->swr);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+static void audio_format_free(AudioFormat *af)
+{
+    if (af->swr) {
+        swr_free(&af->swr);
+    }
+    else {
+        /* nothing */
+    }
+
+    free(af->buffer);
+    af->buffer = NULL;
+    af->buffer_size = 0;
+}
+
+#endif
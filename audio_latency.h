@@ -0,0 +1,100 @@
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+#include "audio_ring.h"
+#include "metrics.h"
+
+/* Device buffer without a target, and the smallest one with */
+#define AUDIO_LATENCY_SAMPLES      1024
+#define AUDIO_LATENCY_MIN_SAMPLES  64
+
+/*
+ * Output latency is the device buffer plus whatever is queued in the
+ * ring in front of it, so both are sized from one setting:
+ *   AUDIO_LATENCY_MS  target latency; unset keeps the 1024-sample device
+ *                     buffer and the ring each player always had
+ * A third of the target goes to the device buffer (a power of two of
+ * samples) and the rest to the ring, which still holds at least two
+ * device buffers so a refill in flight is not an underrun. Low targets
+ * (under 30 ms) trade underruns for responsiveness, high ones the other
+ * way; make bench-latency measures both for a range of targets.
+ */
+static int audio_latency_target(void)
+{
+    const char *env = getenv("AUDIO_LATENCY_MS");
+
+    return env && atoi(env) > 0 ? atoi(env) : 0;
+}
+
+/* SDL_AudioSpec.samples for a device at 'rate' */
+static Uint16 audio_latency_samples(int rate)
+{
+    int target = audio_latency_target();
+    int limit = (int)((Sint64)rate * target / 3000);
+    int samples = AUDIO_LATENCY_MIN_SAMPLES;
+
+    if (target == 0) {
+        return AUDIO_LATENCY_SAMPLES;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (samples * 2 <= limit && samples < 32768) {
+        samples *= 2;
+    }
+
+    return (Uint16)samples;
+}
+
+/* Ring bytes in front of a device buffer of 'samples' at 'rate', or the
+ * player's own 'fallback' without a target; low water is half of it */
+static int audio_latency_ring(int rate, int frame_size, int samples,
+    int fallback)
+{
+    int target = audio_latency_target();
+    int bytes = (int)((Sint64)rate * target / 1000 - samples) * frame_size;
+
+    if (target == 0) {
+        return fallback;
+    }
+    else if (bytes < 2 * samples * frame_size) {
+        return 2 * samples * frame_size;
+    }
+    else {
+        return bytes;
+    }
+}
+
+/* Print what the callback saw, and hand it to the metrics for BENCH */
+static void audio_latency_report(AudioRing *ring, int bytes_per_second,
+    Metrics *m)
+{
+    double device = (double)ring->device_len * 1000.0 / bytes_per_second;
+    double mean = ring->callbacks > 0 ?
+        (double)ring->queued_sum / ring->callbacks * 1000.0 /
+            bytes_per_second + device : 0.0;
+    double max = ring->callbacks > 0 ?
+        (double)ring->queued_max * 1000.0 / bytes_per_second + device : 0.0;
+    int underruns = SDL_AtomicGet(&ring->underruns);
+    int target = audio_latency_target();
+
+    printf("Audio latency: ");
+    if (target > 0) {
+        printf("target %d ms, ", target);
+    }
+    else {
+        /* nothing */
+    }
+    printf("device buffer %.1f ms, ring up to %.1f ms, output mean %.1f ms "
+        "max %.1f ms\n", device,
+        (double)ring->capacity * 1000.0 / bytes_per_second, mean, max);
+    printf("Audio underruns: %d\n", underruns);
+
+    metrics_latency(m, target, mean, max, underruns);
+}
+
+#endif
@@ -2,11 +2,13 @@
 #include <SDL2/SDL.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libswresample/swresample.h>
+#include "audio_format.h"
+#include "audio_latency.h"
+#include "audio_ring.h"
+#include "metrics.h"
+#include "stream_info.h"
 
 #define AUDIO_FILE   "audio.mp4"
-#define SAMPLE_RATE  44100
-#define CHANNELS     2
 
 int main(void)
 {
@@ -15,13 +17,17 @@ int main(void)
     const AVCodec *codec = NULL;
     AVFrame *frame = NULL;
     AVPacket *packet = NULL;
-    SwrContext *swr_ctx = NULL;
     SDL_AudioDeviceID dev = 0;
-    uint8_t *out_buffer = NULL;
-    int out_buffer_size = 0;
+    AudioFormat af;
+    AudioRing ring;
+    Metrics metrics;
     int audio_stream = -1;
     int ret = 1;
 
+    SDL_memset(&af, 0, sizeof(af));
+    SDL_memset(&ring, 0, sizeof(ring));
+    metrics_init(&metrics, "audio_mp4");
+
     /* Open audio file */
     if (avformat_open_input(&fmt_ctx, AUDIO_FILE, NULL, NULL) < 0) {
         fprintf(stderr, "Could not open %s\n", AUDIO_FILE);
@@ -31,7 +37,7 @@ int main(void)
         /* nothing */
     }
 
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    if (stream_info_find(fmt_ctx, AUDIO_FILE, &metrics) < 0) {
         fprintf(stderr, "Could not find stream info\n");
         goto cleanup;
     }
@@ -95,19 +101,6 @@ int main(void)
         /* nothing */
     }
 
-    /* Set up resampler */
-    swr_ctx = swr_alloc_set_opts(NULL,
-        AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, SAMPLE_RATE,
-        codec_ctx->channel_layout, codec_ctx->sample_fmt,
-        codec_ctx->sample_rate, 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not init resampler\n");
-        goto cleanup;
-    }
-    else {
-        /* nothing */
-    }
-
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
@@ -117,15 +110,16 @@ int main(void)
         /* nothing */
     }
 
-    /* Open audio device */
+    /* Open audio device in the source's own format if it takes it; the
+     * callback stays silent until the device is unpaused */
     SDL_AudioSpec spec;
-    spec.freq = SAMPLE_RATE;
-    spec.format = AUDIO_S16LSB;
-    spec.channels = CHANNELS;
-    spec.samples = 1024;
-    spec.callback = NULL;
+    SDL_AudioSpec have;
+    audio_format_request(&spec, codec_ctx);
+    spec.samples = audio_latency_samples(spec.freq);
+    spec.callback = audio_ring_callback;
+    spec.userdata = &ring;
 
-    dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    dev = audio_format_open(&spec, &have);
     if (!dev) {
         fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
         goto cleanup;
@@ -134,6 +128,28 @@ int main(void)
         /* nothing */
     }
 
+    if (audio_format_init(&af, &have, codec_ctx) < 0) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* About a second of audio or AUDIO_LATENCY_MS, refilled once it
+     * drops below half */
+    int ring_size = audio_latency_ring(af.rate, af.frame_size, have.samples,
+        af.bytes_per_second);
+    if (audio_ring_init(&ring, ring_size, ring_size / 2,
+            af.frame_size) < 0) {
+        fprintf(stderr, "Could not allocate audio ring\n");
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    ring.silence = have.silence;
+
     /* Allocate frame and packet */
     frame = av_frame_alloc();
     packet = av_packet_alloc();
@@ -151,48 +167,41 @@ int main(void)
     /* Main loop */
     SDL_Event event;
     int quit = 0;
+    Uint64 t = metrics_begin();
 
     while (!quit && av_read_frame(fmt_ctx, packet) >= 0) {
+        t = metrics_end(&metrics, METRICS_READ, t);
+
         if (packet->stream_index == audio_stream) {
+            Uint64 decode = 0;
+
             if (avcodec_send_packet(codec_ctx, packet) >= 0) {
                 while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
-                    /* Calculate output size */
-                    int out_samples = swr_get_out_samples(swr_ctx,
-                        frame->nb_samples);
-                    int needed_size = out_samples * CHANNELS * 2;
-
-                    if (needed_size > out_buffer_size) {
-                        free(out_buffer);
-                        out_buffer = malloc(needed_size);
-                        out_buffer_size = needed_size;
-                    }
-                    else {
-                        /* buffer is big enough */
-                    }
+                    metrics_lap(&decode, t);
 
-                    /* Resample */
-                    uint8_t *out_planes[] = { out_buffer };
-                    int converted = swr_convert(swr_ctx, out_planes,
-                        out_samples,
-                        (const uint8_t **)frame->data, frame->nb_samples);
+                    /* Into the device's format, if it is not already */
+                    const Uint8 *out = NULL;
+                    Uint64 r = metrics_begin();
+                    int converted = audio_format_convert(&af, frame, &out);
+                    metrics_end(&metrics, METRICS_RESAMPLE, r);
 
+                    /* Sleeps until the callback drains below low water
+                     * whenever the ring is full */
                     if (converted > 0) {
-                        SDL_QueueAudio(dev, out_buffer,
-                            converted * CHANNELS * 2);
+                        audio_ring_write_all(&ring, out, converted, NULL);
+                        metrics_first(&metrics);
                     }
                     else {
                         /* nothing */
                     }
-
-                    /* Limit queue size */
-                    while (SDL_GetQueuedAudioSize(dev) > SAMPLE_RATE * 4) {
-                        SDL_Delay(10);
-                    }
+                    t = metrics_begin();
                 }
             }
             else {
                 /* decode error, skip */
             }
+            t = metrics_lap(&decode, t);
+            metrics_add(&metrics, METRICS_DECODE, decode);
         }
         else {
             /* not audio packet */
@@ -200,6 +209,9 @@ int main(void)
 
         av_packet_unref(packet);
 
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
+
         /* Handle events */
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
@@ -216,25 +228,26 @@ int main(void)
     }
 
     /* Wait for audio to finish */
+    audio_ring_finish(&ring);
     if (!quit) {
-        while (SDL_GetQueuedAudioSize(dev) > 0) {
+        while (audio_ring_fill(&ring) >= af.frame_size) {
             SDL_Delay(10);
         }
+        SDL_Delay(1000 * have.samples / have.freq);
     }
     else {
         /* nothing */
     }
 
+    audio_latency_report(&ring, af.bytes_per_second, &metrics);
+
+    metrics_audio(&metrics, (Uint64)(audio_ring_played(&ring,
+        af.bytes_per_second) / af.frame_size));
+    metrics_report(&metrics);
+
     ret = 0;
 
 cleanup:
-    if (out_buffer) {
-        free(out_buffer);
-    }
-    else {
-        /* nothing */
-    }
-
     if (packet) {
         av_packet_free(&packet);
     }
@@ -249,12 +262,7 @@ cleanup:
         /* nothing */
     }
 
-    if (swr_ctx) {
-        swr_free(&swr_ctx);
-    }
-    else {
-        /* nothing */
-    }
+    audio_format_free(&af);
 
     if (dev) {
         SDL_CloseAudioDevice(dev);
@@ -265,6 +273,8 @@ cleanup:
 
     SDL_Quit();
 
+    audio_ring_destroy(&ring);
+
     if (codec_ctx) {
         avcodec_free_context(&codec_ctx);
     }
@@ -1,19 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <SDL2/SDL.h>
+#include "audio_latency.h"
+#include "audio_ring.h"
+#include "metrics.h"
+#include "prefetch.h"
 
 #define AUDIO_FILE   "audio.pcm"
 #define SAMPLE_RATE  44100
 #define CHANNELS     2
-#define BUFFER_SIZE  4096
 
 int main(void)
 {
     FILE *fp = NULL;
     SDL_AudioDeviceID dev = 0;
-    unsigned char *buffer = NULL;
+    AudioRing ring;
+    Prefetch prefetch;
+    Metrics metrics;
     int ret = 1;
 
+    SDL_memset(&ring, 0, sizeof(ring));
+    SDL_memset(&prefetch, 0, sizeof(prefetch));
+    metrics_init(&metrics, "audio_pcm");
+
     /* Open audio file */
     fp = fopen(AUDIO_FILE, "rb");
     if (!fp) {
@@ -24,9 +33,13 @@ int main(void)
         /* nothing */
     }
 
-    /* Allocate buffer */
-    buffer = malloc(BUFFER_SIZE);
-    if (!buffer) {
+    /* Allocate PREFETCH_AUDIO_MS of ring, or what AUDIO_LATENCY_MS
+     * leaves after the device buffer, and start filling it */
+    Uint16 samples = audio_latency_samples(SAMPLE_RATE);
+    int ring_size = audio_latency_ring(SAMPLE_RATE, CHANNELS * 2, samples,
+        prefetch_audio_bytes(SAMPLE_RATE * CHANNELS * 2));
+    if (audio_ring_init(&ring, ring_size, ring_size / 2,
+            CHANNELS * 2) < 0) {
         fprintf(stderr, "Could not allocate buffer\n");
         goto cleanup;
     }
@@ -34,6 +47,13 @@ int main(void)
         /* nothing */
     }
 
+    if (prefetch_start(&prefetch, NULL, fp, &ring) < 0) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
@@ -45,13 +65,15 @@ int main(void)
 
     /* Open audio device */
     SDL_AudioSpec spec;
+    SDL_AudioSpec have;
     spec.freq = SAMPLE_RATE;
     spec.format = AUDIO_S16LSB;
     spec.channels = CHANNELS;
-    spec.samples = 1024;
-    spec.callback = NULL;
+    spec.samples = samples;
+    spec.callback = audio_ring_callback;
+    spec.userdata = &ring;
 
-    dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    dev = SDL_OpenAudioDevice(NULL, 0, &spec, &have, 0);
     if (!dev) {
         fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
         goto cleanup;
@@ -60,32 +82,29 @@ int main(void)
         /* nothing */
     }
 
+    ring.silence = have.silence;
+
     /* Start playback */
     SDL_PauseAudioDevice(dev, 0);
 
     /* Main loop */
     SDL_Event event;
     int quit = 0;
-    size_t bytes_read;
 
     while (!quit) {
-        /* Keep audio buffer filled */
-        while (SDL_GetQueuedAudioSize(dev) < BUFFER_SIZE * 4) {
-            bytes_read = fread(buffer, 1, BUFFER_SIZE, fp);
-            if (bytes_read == 0) {
-                /* Wait for remaining audio to play */
-                while (SDL_GetQueuedAudioSize(dev) > 0) {
-                    SDL_Delay(10);
-                }
-                quit = 1;
-                break;
-            }
-            else {
-                SDL_QueueAudio(dev, buffer, bytes_read);
-            }
+        /* The prefetch thread feeds the ring; finish once it ran dry */
+        if (SDL_AtomicGet(&ring.finished) &&
+            audio_ring_fill(&ring) < CHANNELS * 2) {
+            /* Let the device play out its last buffer */
+            SDL_Delay(1000 * have.samples / have.freq);
+            quit = 1;
+        }
+        else {
+            SDL_Delay(10);
         }
 
-        SDL_Delay(10);
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
 
         /* Handle events */
         while (SDL_PollEvent(&event)) {
@@ -102,15 +121,17 @@ int main(void)
         }
     }
 
+    audio_latency_report(&ring, SAMPLE_RATE * CHANNELS * 2, &metrics);
+    prefetch_report(&prefetch);
+
+    metrics_audio(&metrics, (Uint64)(audio_ring_played(&ring,
+        SAMPLE_RATE * CHANNELS * 2) / (CHANNELS * 2)));
+    metrics_report(&metrics);
+
     ret = 0;
 
 cleanup:
-    if (buffer) {
-        free(buffer);
-    }
-    else {
-        /* nothing */
-    }
+    prefetch_stop(&prefetch);
 
     if (dev) {
         SDL_CloseAudioDevice(dev);
@@ -119,6 +140,8 @@ cleanup:
         /* nothing */
     }
 
+    audio_ring_destroy(&ring);
+
     SDL_Quit();
 
     if (fp) {
@@ -0,0 +1,341 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <SDL2/SDL.h>
+
+/*
+ * Single-producer/single-consumer byte ring between the player and the
+ * SDL audio callback. The counters are free-running and each is written
+ * by one side only, so the callback never takes a lock on the audio
+ * path. The played-bytes clock the callback keeps for the player is
+ * published under a sequence counter: the callback never waits on it,
+ * and a reader that overlapped an update just reads again. The producer
+ * sleeps on 'wake' until the callback has drained the ring below its
+ * low-water mark. The callback also records how much was
+ * still queued each time the device took a buffer, which is the latency
+ * the ring adds in front of the device.
+ */
+typedef struct {
+    Uint8 *data;
+    int size;
+    int capacity;
+    int low_water;
+    int frame_size;
+    Uint8 silence;
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    SDL_atomic_t waiting;
+    SDL_atomic_t finished;
+    SDL_atomic_t underruns;
+    SDL_sem *wake;
+    SDL_atomic_t clock_seq;
+    Uint64 consumed;
+    Uint64 last_len;
+    Uint64 last_time;
+    Uint64 callbacks;
+    Uint64 queued_sum;
+    int queued_max;
+    int device_len;
+} AudioRing;
+
+/* 'size' is the most the ring holds, in whole sample frames; the storage
+ * is rounded up to a power of two. 'frame_size' is the bytes of one
+ * sample across all channels, the unit the callback consumes in */
+static int audio_ring_init(AudioRing *ring, int size, int low_water,
+    int frame_size)
+{
+    int pow2 = 1;
+
+    SDL_memset(ring, 0, sizeof(*ring));
+
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+
+    ring->size = pow2;
+    ring->capacity = size - size % frame_size;
+    ring->low_water = low_water;
+    ring->frame_size = frame_size;
+    ring->data = malloc(pow2);
+    ring->wake = SDL_CreateSemaphore(0);
+    if (!ring->data || !ring->wake) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Callback (or with the device locked): update the played-bytes clock.
+ * 'clock_seq' is odd while the fields are being written */
+static void audio_ring_publish(AudioRing *ring, Uint64 consumed,
+    Uint64 last_len, Uint64 last_time)
+{
+    SDL_AtomicAdd(&ring->clock_seq, 1);
+    SDL_MemoryBarrierRelease();
+    ring->consumed = consumed;
+    ring->last_len = last_len;
+    ring->last_time = last_time;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&ring->clock_seq, 1);
+}
+
+static void audio_ring_destroy(AudioRing *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+
+    if (ring->wake) {
+        SDL_DestroySemaphore(ring->wake);
+        ring->wake = NULL;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Bytes queued and not yet handed to the device */
+static int audio_ring_fill(AudioRing *ring)
+{
+    return (int)((unsigned)SDL_AtomicGet(&ring->write) -
+                 (unsigned)SDL_AtomicGet(&ring->read));
+}
+
+/* Producer: contiguous free space starting at *ptr */
+static int audio_ring_write_ptr(AudioRing *ring, Uint8 **ptr)
+{
+    unsigned w = (unsigned)SDL_AtomicGet(&ring->write);
+    int offset = (int)(w & (unsigned)(ring->size - 1));
+    int space = ring->capacity - audio_ring_fill(ring);
+    int contiguous = ring->size - offset;
+
+    *ptr = ring->data + offset;
+
+    return space < contiguous ? space : contiguous;
+}
+
+/* Producer: publish 'len' bytes written through audio_ring_write_ptr */
+static void audio_ring_commit(AudioRing *ring, int len)
+{
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&ring->write, len);
+}
+
+/* Producer: copy as much of 'src' as fits; returns bytes written */
+static int audio_ring_write(AudioRing *ring, const Uint8 *src, int len)
+{
+    int done = 0;
+
+    while (done < len) {
+        Uint8 *dst;
+        int n = audio_ring_write_ptr(ring, &dst);
+
+        if (n <= 0) {
+            break;
+        }
+        else if (n > len - done) {
+            n = len - done;
+        }
+        else {
+            /* nothing */
+        }
+
+        SDL_memcpy(dst, src + done, n);
+        audio_ring_commit(ring, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Producer: sleep until the ring drops below low water (or timeout) */
+static void audio_ring_wait(AudioRing *ring, Uint32 timeout_ms)
+{
+    SDL_AtomicSet(&ring->waiting, 1);
+
+    /* Re-check after announcing, so a wakeup cannot slip in between */
+    if (audio_ring_fill(ring) >= ring->low_water) {
+        SDL_SemWaitTimeout(ring->wake, timeout_ms);
+    }
+    else {
+        /* nothing */
+    }
+
+    SDL_AtomicSet(&ring->waiting, 0);
+
+    /* Swallow a wakeup that raced with the timeout */
+    while (SDL_SemTryWait(ring->wake) == 0) {
+        /* nothing */
+    }
+}
+
+/* Producer: write all of 'src', sleeping while the ring is full;
+ * returns -1 if 'abort' got set meanwhile */
+static int audio_ring_write_all(AudioRing *ring, const Uint8 *src, int len,
+    SDL_atomic_t *abort)
+{
+    int done = 0;
+
+    while (done < len) {
+        done += audio_ring_write(ring, src + done, len - done);
+        if (done < len) {
+            if (abort && SDL_AtomicGet(abort)) {
+                return -1;
+            }
+            else {
+                audio_ring_wait(ring, 10);
+            }
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return 0;
+}
+
+/* Producer: no more data, so running dry is the end and not an underrun */
+static void audio_ring_finish(AudioRing *ring)
+{
+    SDL_AtomicSet(&ring->finished, 1);
+}
+
+/* Both sides stopped (producer idle, device locked): drop everything
+ * queued and restart the played-bytes clock from zero */
+static void audio_ring_reset(AudioRing *ring)
+{
+    SDL_AtomicSet(&ring->read, 0);
+    SDL_AtomicSet(&ring->write, 0);
+    SDL_AtomicSet(&ring->waiting, 0);
+    SDL_AtomicSet(&ring->finished, 0);
+
+    audio_ring_publish(ring, 0, 0, 0);
+
+    while (SDL_SemTryWait(ring->wake) == 0) {
+        /* nothing */
+    }
+}
+
+/* Consumer: copy out up to 'len' bytes in whole sample frames; returns
+ * the bytes copied */
+static int audio_ring_read(AudioRing *ring, Uint8 *dst, int len)
+{
+    int fill = audio_ring_fill(ring);
+    int n = fill < len ? fill - fill % ring->frame_size : len;
+    unsigned r = (unsigned)SDL_AtomicGet(&ring->read);
+    int offset = (int)(r & (unsigned)(ring->size - 1));
+    int first = ring->size - offset;
+
+    SDL_MemoryBarrierAcquire();
+
+    if (first > n) {
+        first = n;
+    }
+    else {
+        /* nothing */
+    }
+
+    SDL_memcpy(dst, ring->data + offset, first);
+    SDL_memcpy(dst + first, ring->data, n - first);
+
+    SDL_AtomicAdd(&ring->read, n);
+
+    audio_ring_publish(ring, ring->consumed + n, n,
+        SDL_GetPerformanceCounter());
+
+    if (SDL_AtomicGet(&ring->waiting) &&
+        audio_ring_fill(ring) < ring->low_water &&
+        SDL_AtomicCAS(&ring->waiting, 1, 0)) {
+        SDL_SemPost(ring->wake);
+    }
+    else {
+        /* nothing */
+    }
+
+    return n;
+}
+
+/* SDL_AudioSpec.callback: userdata is the AudioRing */
+static void audio_ring_callback(void *userdata, Uint8 *stream, int len)
+{
+    AudioRing *ring = userdata;
+    int n = audio_ring_read(ring, stream, len);
+
+    /* Steady-state latency only: not before the first data or while the
+     * last of it plays out */
+    if (n == len && !SDL_AtomicGet(&ring->finished)) {
+        int queued = audio_ring_fill(ring);
+
+        ring->callbacks++;
+        ring->queued_sum += queued;
+        if (queued > ring->queued_max) {
+            ring->queued_max = queued;
+        }
+        else {
+            /* nothing */
+        }
+        ring->device_len = len;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (n < len) {
+        SDL_memset(stream + n, ring->silence, len - n);
+
+        /* Running dry before the first data or after the last is fine */
+        if (ring->consumed > (Uint64)n && !SDL_AtomicGet(&ring->finished)) {
+            SDL_AtomicAdd(&ring->underruns, 1);
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/*
+ * Bytes actually heard: everything handed to the device before the last
+ * callback, plus how far the device has played into that last chunk.
+ */
+static double audio_ring_played(AudioRing *ring, int bytes_per_second)
+{
+    Uint64 consumed;
+    Uint64 last_len;
+    Uint64 last_time;
+    int seq;
+
+    /* Retry while the callback is mid-update or updated meanwhile */
+    do {
+        seq = SDL_AtomicGet(&ring->clock_seq);
+        SDL_MemoryBarrierAcquire();
+        consumed = ring->consumed;
+        last_len = ring->last_len;
+        last_time = ring->last_time;
+        SDL_MemoryBarrierAcquire();
+    } while ((seq & 1) || SDL_AtomicGet(&ring->clock_seq) != seq);
+
+    if (consumed == 0) {
+        return 0.0;
+    }
+    else {
+        /* nothing */
+    }
+
+    double elapsed = (double)(SDL_GetPerformanceCounter() - last_time) /
+        SDL_GetPerformanceFrequency() * bytes_per_second;
+    if (elapsed > (double)last_len) {
+        elapsed = (double)last_len;
+    }
+    else {
+        /* nothing */
+    }
+
+    return (double)(consumed - last_len) + elapsed;
+}
+
+#endif
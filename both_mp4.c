@@ -3,160 +3,1036 @@
 #include <SDL2/SDL.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
-#include <libswresample/swresample.h>
+#include "audio_format.h"
+#include "audio_latency.h"
+#include "audio_ring.h"
+#include "decode_threads.h"
+#include "frame_format.h"
+#include "frame_queue.h"
+#include "kf_index.h"
+#include "metrics.h"
+#include "playlist.h"
+#include "stream_info.h"
+#include "texture_pool.h"
+#include "yuv_rgb.h"
+#include "packet_queue.h"
 
 #define VIDEO_FILE   "video.mp4"
-#define SAMPLE_RATE  44100
-#define CHANNELS     2
 
-int main(void)
+/* Demuxer read-ahead per stream */
+#define PACKET_QUEUE_BYTES    (8 * 1024 * 1024)
+#define PACKET_QUEUE_SECONDS  2.0
+
+/* Late-frame policy: drop frames this far past their deadline, and after
+ * DROP_ESCALATE drops in a row ask the decoder to skip more frames;
+ * DROP_RELAX frames on time in a row step back down again */
+#define DROP_THRESHOLD  0.020
+#define DROP_ESCALATE   8
+#define DROP_RELAX      120
+
+/* Packets sent under a raised discard level not yet matched to a frame */
+#define DISCARD_PENDING  64
+
+#define SEEK_SHORT  5.0
+#define SEEK_LONG   60.0
+
+/*
+ * What outlives a playlist item: the audio device and its ring, and the
+ * master clock. Clock times are playlist time, which runs on from one
+ * item into the next; each item maps its own stream time onto it.
+ */
+typedef struct {
+    AudioFormat af;
+    AudioRing ring;
+    SDL_AudioDeviceID audio_dev;
+    SDL_mutex *clock_mutex;
+    double audio_end;
+    Uint64 audio_written;
+    double clock_offset;
+    int audio_started;
+    SDL_atomic_t skip_frame;
+    int frames_discarded;
+    int frames_skipped;
+    TexturePool *pool;
+    Metrics *metrics;
+} Output;
+
+/*
+ * One playlist item: its demuxer, decoders and their threads. The next
+ * item is opened on a loader thread while this one plays, and its demux
+ * and video threads run until the queues are full, so its first frames
+ * are decoded before they are due. When this item's audio runs out its
+ * audio thread starts the next item's right where it ends, so the ring
+ * never runs dry; the render loop moves on once the last frame is shown.
+ */
+typedef struct Decoder {
+    const char *path;
+    Output *out;
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *vcodec_ctx;
+    AVCodecContext *acodec_ctx;
+    int video_stream;
+    int audio_stream;
+    PacketQueue videoq;
+    PacketQueue audioq;
+    FrameQueue queue;
+    SDL_Thread *loader;
+    SDL_Thread *demuxer;
+    SDL_Thread *video_decoder;
+    SDL_Thread *audio_decoder;
+    SDL_atomic_t ready;
+    SDL_atomic_t audio_live;
+    SDL_atomic_t chained;
+    struct Decoder *next;
+    Uint64 ready_at;
+    double video_tb;
+    double audio_tb;
+    double start;
+    double offset;
+    KfIndex index;
+    int64_t skip_until;
+    double audio_skip_until;
+    int frames_skipped;
+    int64_t discard_pts[DISCARD_PENDING];
+    int discard_pending;
+    int keyed;
+    int frames_discarded;
+    Metrics *metrics;
+    Metrics preload;
+    Metrics audio;
+} Decoder;
+
+/* Decoder discard levels, mildest first */
+static const enum AVDiscard discard_levels[] = {
+    AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR
+};
+
+static const char *discard_names[] = { "default", "nonref", "bidir" };
+
+/*
+ * Master clock in seconds of playlist time. While audio is playing it is
+ * the time at the end of the written audio minus what the device has not
+ * played yet; otherwise wall time continues from there.
+ */
+static double master_clock(Output *out)
+{
+    double now = SDL_GetTicks() / 1000.0;
+    double played = audio_ring_played(&out->ring, out->af.bytes_per_second);
+    double clock;
+
+    SDL_LockMutex(out->clock_mutex);
+    double pending = (double)out->audio_written - played;
+    if (out->audio_started && pending >= out->af.frame_size) {
+        clock = out->audio_end - pending / out->af.bytes_per_second;
+        out->clock_offset = clock - now;
+    }
+    else {
+        clock = now + out->clock_offset;
+    }
+    SDL_UnlockMutex(out->clock_mutex);
+
+    return clock;
+}
+
+/* Convert one decoded audio frame to the device's format and queue it */
+static void queue_audio(Decoder *dec, AVFrame *frame)
+{
+    Output *out = dec->out;
+    const Uint8 *data = NULL;
+    Uint64 t = metrics_begin();
+    int converted = audio_format_convert(&out->af, frame, &data);
+    metrics_end(&dec->audio, METRICS_RESAMPLE, t);
+
+    /* Sleeps until the callback drains below low water if the ring is
+     * full; backpressure here only ever stalls the audio decoder */
+    if (converted <= 0 ||
+        audio_ring_write_all(&out->ring, data, converted,
+            &dec->audioq.abort) < 0) {
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Advance the written count and end time together */
+    SDL_LockMutex(out->clock_mutex);
+    out->audio_written += converted;
+    if (frame_queue_time(frame) != AV_NOPTS_VALUE) {
+        /* Samples still held inside the resampler are not queued yet */
+        out->audio_end = dec->offset +
+            frame_queue_time(frame) * dec->audio_tb +
+            (double)frame->nb_samples / frame->sample_rate -
+            audio_format_delay(&out->af);
+    }
+    else {
+        out->audio_end += (double)converted / out->af.bytes_per_second;
+    }
+    out->audio_started = 1;
+    SDL_UnlockMutex(out->clock_mutex);
+}
+
+/* Video frames between a seek's keyframe and its target are decoded only */
+static int video_skip(Decoder *dec, AVFrame *frame)
+{
+    if (dec->skip_until == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    else if (frame_queue_time(frame) != AV_NOPTS_VALUE &&
+             frame_queue_time(frame) < dec->skip_until) {
+        dec->frames_skipped++;
+        return 1;
+    }
+    else {
+        dec->skip_until = AV_NOPTS_VALUE;
+        return 0;
+    }
+}
+
+/* Audio that ends before a seek's target is not played */
+static int audio_skip(Decoder *dec, AVFrame *frame)
+{
+    if (dec->audio_skip_until < 0.0) {
+        return 0;
+    }
+    else if (frame_queue_time(frame) != AV_NOPTS_VALUE &&
+             frame_queue_time(frame) * dec->audio_tb +
+                 (double)frame->nb_samples / frame->sample_rate <=
+                 dec->audio_skip_until) {
+        return 1;
+    }
+    else {
+        dec->audio_skip_until = -1.0;
+        return 0;
+    }
+}
+
+/*
+ * Frames the decoder skipped under a raised discard level. Each packet
+ * sent under it is held by its PTS until a frame settles it: frames come
+ * out in presentation order, so a frame with that PTS means the packet was
+ * decoded and one past it means it never will be, and a drained decoder
+ * settles the rest. A flush drops whatever is unsettled, and packets
+ * before the first keyframe after it are not held, since the decoder
+ * drops those at any level.
+ */
+static void discard_sent(Decoder *dec, AVPacket *packet, int level)
+{
+    if (packet->flags & AV_PKT_FLAG_KEY) {
+        dec->keyed = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* A full list only ever undercounts */
+    if (level > 0 && dec->keyed && packet->pts != AV_NOPTS_VALUE &&
+        dec->discard_pending < DISCARD_PENDING) {
+        dec->discard_pts[dec->discard_pending++] = packet->pts;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* A frame with 'pts' came out, or with 'drained' the decoder is empty */
+static void discard_settle(Decoder *dec, int64_t pts, int drained)
+{
+    int kept = 0;
+
+    for (int i = 0; i < dec->discard_pending; i++) {
+        if (drained || dec->discard_pts[i] < pts) {
+            dec->frames_discarded++;
+        }
+        else if (dec->discard_pts[i] > pts) {
+            dec->discard_pts[kept++] = dec->discard_pts[i];
+        }
+        else {
+            /* decoded */
+        }
+    }
+    dec->discard_pending = kept;
+}
+
+/* Demux thread: route packets to the per-stream queues until EOF */
+static int demux_thread(void *arg)
+{
+    Decoder *dec = arg;
+    AVPacket *packet = av_packet_alloc();
+    int quit = 0;
+
+    if (!packet) {
+        fprintf(stderr, "Could not allocate packet\n");
+        quit = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    Uint64 t = metrics_begin();
+    while (!quit && av_read_frame(dec->fmt_ctx, packet) >= 0) {
+        metrics_end(dec->metrics, METRICS_READ, t);
+
+        if (packet->stream_index == dec->video_stream) {
+            if (packet_queue_put(&dec->videoq, packet) < 0) {
+                quit = 1;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else if (packet->stream_index == dec->audio_stream) {
+            if (packet_queue_put(&dec->audioq, packet) < 0) {
+                quit = 1;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else {
+            /* other stream */
+        }
+
+        av_packet_unref(packet);
+        t = metrics_begin();
+    }
+
+    packet_queue_finish(&dec->videoq);
+    packet_queue_finish(&dec->audioq);
+
+    av_packet_free(&packet);
+
+    return 0;
+}
+
+/* Video thread: decode video packets into the frame queue */
+static int video_thread(void *arg)
+{
+    Decoder *dec = arg;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int quit = 0;
+
+    if (!packet || !frame) {
+        fprintf(stderr, "Could not allocate frame/packet\n");
+        quit = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (!quit) {
+        int got = packet_queue_get(&dec->videoq, packet);
+        Uint64 t = metrics_begin();
+        Uint64 decode = 0;
+        int level = SDL_AtomicGet(&dec->out->skip_frame);
+
+        /* Apply the discard level picked by the render thread */
+        dec->vcodec_ctx->skip_frame = discard_levels[level];
+
+        /* An empty packet at EOF drains the decoder */
+        if (got < 0) {
+            quit = 1;
+        }
+        else if (avcodec_send_packet(dec->vcodec_ctx,
+                     got ? packet : NULL) >= 0) {
+            if (got) {
+                discard_sent(dec, packet, level);
+            }
+            else {
+                /* nothing */
+            }
+
+            while (!quit &&
+                   avcodec_receive_frame(dec->vcodec_ctx, frame) >= 0) {
+                metrics_lap(&decode, t);
+                if (frame->pts != AV_NOPTS_VALUE) {
+                    discard_settle(dec, frame->pts, 0);
+                }
+                else {
+                    /* nothing */
+                }
+
+                if (video_skip(dec, frame)) {
+                    av_frame_unref(frame);
+                }
+                else if (frame_queue_push(&dec->queue, frame) < 0) {
+                    quit = 1;
+                }
+                else {
+                    /* nothing */
+                }
+                t = metrics_begin();
+            }
+
+            if (got == 0 && !quit) {
+                discard_settle(dec, 0, 1);
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else {
+            /* decode error */
+        }
+
+        /* One sample per packet sent, the draining one included */
+        if (got >= 0) {
+            metrics_lap(&decode, t);
+            metrics_add(dec->metrics, METRICS_DECODE, decode);
+        }
+        else {
+            /* nothing */
+        }
+
+        av_packet_unref(packet);
+
+        if (got == 0) {
+            quit = 1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    frame_queue_finish(&dec->queue);
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+
+    return 0;
+}
+
+static int audio_thread(void *arg);
+
+/* Start the audio thread, whose frames go straight to the ring */
+static int decoder_start_audio(Decoder *dec)
+{
+    dec->audio_decoder = SDL_CreateThread(audio_thread, "audio", dec);
+    if (!dec->audio_decoder) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/*
+ * Audio thread at the end of its item: wait until the render thread has
+ * published the next item as loaded, place it on the playlist timeline
+ * right where this audio ends and start its audio thread. A seek or the
+ * end of the playlist ends the wait instead.
+ */
+static void decoder_handover(Decoder *dec)
+{
+    Output *out = dec->out;
+    Decoder *next = NULL;
+
+    while (!next) {
+        if (SDL_AtomicGet(&dec->audioq.abort) ||
+            !SDL_AtomicGet(&dec->chained)) {
+            return;
+        }
+        else {
+            next = SDL_AtomicGetPtr((void **)&dec->next);
+        }
+
+        if (!next) {
+            SDL_Delay(1);
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    /* A seek aborts this item under the same lock, so either the seek
+     * or the handover happens, never both */
+    SDL_LockMutex(out->clock_mutex);
+    if (!SDL_AtomicGet(&dec->audioq.abort)) {
+        next->offset = out->audio_end - next->start;
+        SDL_AtomicSet(&next->audio_live,
+            decoder_start_audio(next) == 0 ? 1 : -1);
+    }
+    else {
+        /* nothing */
+    }
+    SDL_UnlockMutex(out->clock_mutex);
+}
+
+/* Audio thread: decode audio packets and queue them on the device */
+static int audio_thread(void *arg)
+{
+    Decoder *dec = arg;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int quit = 0;
+    int got = -1;
+
+    if (!packet || !frame) {
+        fprintf(stderr, "Could not allocate frame/packet\n");
+        quit = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (!quit) {
+        got = packet_queue_get(&dec->audioq, packet);
+        Uint64 t = metrics_begin();
+        Uint64 decode = 0;
+
+        if (got > 0 && avcodec_send_packet(dec->acodec_ctx, packet) >= 0) {
+            while (avcodec_receive_frame(dec->acodec_ctx, frame) >= 0) {
+                metrics_lap(&decode, t);
+                if (audio_skip(dec, frame)) {
+                    av_frame_unref(frame);
+                }
+                else {
+                    queue_audio(dec, frame);
+                }
+                t = metrics_begin();
+            }
+        }
+        else if (got > 0) {
+            /* decode error */
+        }
+        else {
+            quit = 1;
+        }
+
+        /* One sample per packet, as for video */
+        if (got > 0) {
+            metrics_lap(&decode, t);
+            metrics_add(&dec->audio, METRICS_DECODE, decode);
+        }
+        else {
+            /* nothing */
+        }
+
+        av_packet_unref(packet);
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+
+    /* End of the item, not an abort: the next one carries on */
+    if (got == 0) {
+        decoder_handover(dec);
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Stop all threads: wake whichever queue each one is blocked on */
+static void decoder_abort(Decoder *dec)
+{
+    packet_queue_abort(&dec->videoq);
+    packet_queue_abort(&dec->audioq);
+    frame_queue_abort(&dec->queue);
+}
+
+/* Start the demux and video threads; -1 if either did not start */
+static int decoder_start(Decoder *dec)
+{
+    dec->demuxer = SDL_CreateThread(demux_thread, "demux", dec);
+    dec->video_decoder = SDL_CreateThread(video_thread, "video", dec);
+    if (!dec->demuxer || !dec->video_decoder) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Wait for whichever threads were started; they must have been told to
+ * stop or be about to finish */
+static void decoder_join(Decoder *dec)
+{
+    if (dec->demuxer) {
+        SDL_WaitThread(dec->demuxer, NULL);
+        dec->demuxer = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (dec->video_decoder) {
+        SDL_WaitThread(dec->video_decoder, NULL);
+        dec->video_decoder = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (dec->audio_decoder) {
+        SDL_WaitThread(dec->audio_decoder, NULL);
+        dec->audio_decoder = NULL;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Render thread: stop 'dec' for a seek, unless its audio already handed
+ * over to the next item; 0 when the seek must not go ahead */
+static int decoder_hold(Decoder *dec)
+{
+    Decoder *next = SDL_AtomicGetPtr((void **)&dec->next);
+    int handed;
+
+    SDL_LockMutex(dec->out->clock_mutex);
+    handed = next && SDL_AtomicGet(&next->audio_live) != 0;
+    if (!handed) {
+        decoder_abort(dec);
+    }
+    else {
+        /* nothing */
+    }
+    SDL_UnlockMutex(dec->out->clock_mutex);
+
+    return !handed;
+}
+
+/*
+ * Stop every thread, put the demuxer on the video keyframe before
+ * 'seconds' (playlist time), drop everything queued downstream of it and
+ * start again. The clock holds at the target until the first audio is
+ * written.
+ */
+static int decoder_seek(Decoder *dec, double seconds)
+{
+    Output *out = dec->out;
+
+    decoder_abort(dec);
+    decoder_join(dec);
+
+    packet_queue_reset(&dec->videoq);
+    packet_queue_reset(&dec->audioq);
+    frame_queue_reset(&dec->queue);
+    avcodec_flush_buffers(dec->vcodec_ctx);
+    avcodec_flush_buffers(dec->acodec_ctx);
+    audio_format_reset(&out->af);
+    dec->discard_pending = 0;
+    dec->keyed = 0;
+
+    dec->skip_until = kf_index_seek(&dec->index, dec->fmt_ctx,
+        dec->video_stream, seconds - dec->offset);
+    dec->audio_skip_until = dec->skip_until * dec->video_tb;
+
+    SDL_LockAudioDevice(out->audio_dev);
+    audio_ring_reset(&out->ring);
+    SDL_UnlockAudioDevice(out->audio_dev);
+
+    SDL_LockMutex(out->clock_mutex);
+    out->audio_written = 0;
+    out->audio_end = dec->offset + dec->audio_skip_until;
+    out->audio_started = 0;
+    out->clock_offset = out->audio_end - SDL_GetTicks() / 1000.0;
+    SDL_UnlockMutex(out->clock_mutex);
+
+    if (decoder_start(dec) < 0 || decoder_start_audio(dec) < 0) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Open, probe and set up the decoders and queues of dec->path */
+static int decoder_open(Decoder *dec)
 {
-    AVFormatContext *fmt_ctx = NULL;
-    AVCodecContext *vcodec_ctx = NULL;
-    AVCodecContext *acodec_ctx = NULL;
     const AVCodec *vcodec = NULL;
     const AVCodec *acodec = NULL;
-    AVFrame *frame = NULL;
-    AVPacket *packet = NULL;
-    SwrContext *swr_ctx = NULL;
-    SDL_Window *window = NULL;
-    SDL_Renderer *renderer = NULL;
-    SDL_Texture *texture = NULL;
-    SDL_AudioDeviceID audio_dev = 0;
-    uint8_t *audio_buffer = NULL;
-    int audio_buffer_size = 0;
-    int video_stream = -1;
-    int audio_stream = -1;
-    int ret = 1;
+    AVFormatContext *fmt_ctx = NULL;
+
+    /* Open file */
+    if (avformat_open_input(&dec->fmt_ctx, dec->path, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open %s\n", dec->path);
+        return -1;
+    }
+    else {
+        fmt_ctx = dec->fmt_ctx;
+    }
+
+    if (stream_info_find(fmt_ctx, dec->path, dec->metrics) < 0) {
+        fprintf(stderr, "Could not find stream info\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Find streams */
+    dec->video_stream = -1;
+    dec->audio_stream = -1;
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            dec->video_stream < 0) {
+            dec->video_stream = i;
+        }
+        else if (fmt_ctx->streams[i]->codecpar->codec_type ==
+                 AVMEDIA_TYPE_AUDIO && dec->audio_stream < 0) {
+            dec->audio_stream = i;
+        }
+        else {
+            /* continue */
+        }
+    }
+
+    if (dec->video_stream < 0 || dec->audio_stream < 0) {
+        fprintf(stderr, "Could not find audio/video streams\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Set up video decoder */
+    vcodec = avcodec_find_decoder(
+        fmt_ctx->streams[dec->video_stream]->codecpar->codec_id);
+    if (!vcodec) {
+        fprintf(stderr, "Unsupported video codec\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    dec->vcodec_ctx = avcodec_alloc_context3(vcodec);
+    if (!dec->vcodec_ctx) {
+        fprintf(stderr, "Could not allocate video codec context\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (avcodec_parameters_to_context(dec->vcodec_ctx,
+            fmt_ctx->streams[dec->video_stream]->codecpar) < 0) {
+        fprintf(stderr, "Could not copy video codec params\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    decode_threads_configure(dec->vcodec_ctx);
+    texture_pool_share(dec->out->pool, dec->vcodec_ctx);
+
+    if (avcodec_open2(dec->vcodec_ctx, vcodec, NULL) < 0) {
+        fprintf(stderr, "Could not open video codec\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    decode_threads_report(dec->vcodec_ctx);
+
+    /* Keyframes for seeking: the sidecar when it is fresh, otherwise
+     * built in the background while playback starts */
+    if (kf_index_open(&dec->index, dec->path, dec->video_stream) < 0) {
+        fprintf(stderr, "No keyframe index, seeks use the demuxer's own\n");
+    }
+    else {
+        /* nothing */
+    }
 
-    /* Open file */
-    if (avformat_open_input(&fmt_ctx, VIDEO_FILE, NULL, NULL) < 0) {
-        fprintf(stderr, "Could not open %s\n", VIDEO_FILE);
-        return 1;
+    /* Set up audio decoder */
+    acodec = avcodec_find_decoder(
+        fmt_ctx->streams[dec->audio_stream]->codecpar->codec_id);
+    if (!acodec) {
+        fprintf(stderr, "Unsupported audio codec\n");
+        return -1;
     }
     else {
         /* nothing */
     }
 
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Could not find stream info\n");
-        goto cleanup;
+    dec->acodec_ctx = avcodec_alloc_context3(acodec);
+    if (!dec->acodec_ctx) {
+        fprintf(stderr, "Could not allocate audio codec context\n");
+        return -1;
     }
     else {
         /* nothing */
     }
 
-    /* Find streams */
-    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
-            video_stream < 0) {
-            video_stream = i;
-        }
-        else if (fmt_ctx->streams[i]->codecpar->codec_type ==
-                 AVMEDIA_TYPE_AUDIO && audio_stream < 0) {
-            audio_stream = i;
-        }
-        else {
-            /* continue */
-        }
+    if (avcodec_parameters_to_context(dec->acodec_ctx,
+            fmt_ctx->streams[dec->audio_stream]->codecpar) < 0) {
+        fprintf(stderr, "Could not copy audio codec params\n");
+        return -1;
+    }
+    else {
+        /* nothing */
     }
 
-    if (video_stream < 0 || audio_stream < 0) {
-        fprintf(stderr, "Could not find audio/video streams\n");
-        goto cleanup;
+    if (avcodec_open2(dec->acodec_ctx, acodec, NULL) < 0) {
+        fprintf(stderr, "Could not open audio codec\n");
+        return -1;
     }
     else {
         /* nothing */
     }
 
-    /* Set up video decoder */
-    vcodec = avcodec_find_decoder(
-        fmt_ctx->streams[video_stream]->codecpar->codec_id);
-    if (!vcodec) {
-        fprintf(stderr, "Unsupported video codec\n");
-        goto cleanup;
+    dec->video_tb = av_q2d(fmt_ctx->streams[dec->video_stream]->time_base);
+    dec->audio_tb = av_q2d(fmt_ctx->streams[dec->audio_stream]->time_base);
+    dec->start = fmt_ctx->start_time != AV_NOPTS_VALUE ?
+        (double)fmt_ctx->start_time / AV_TIME_BASE : 0.0;
+
+    if (packet_queue_init(&dec->videoq, PACKET_QUEUE_BYTES,
+            PACKET_QUEUE_SECONDS,
+            fmt_ctx->streams[dec->video_stream]->time_base) < 0 ||
+        packet_queue_init(&dec->audioq, PACKET_QUEUE_BYTES,
+            PACKET_QUEUE_SECONDS,
+            fmt_ctx->streams[dec->audio_stream]->time_base) < 0 ||
+        frame_queue_init(&dec->queue) < 0) {
+        fprintf(stderr, "Could not allocate queues\n");
+        return -1;
     }
     else {
         /* nothing */
     }
 
-    vcodec_ctx = avcodec_alloc_context3(vcodec);
-    if (!vcodec_ctx) {
-        fprintf(stderr, "Could not allocate video codec context\n");
-        goto cleanup;
+    return 0;
+}
+
+/* Loader thread: open the next item and start decoding its first frames */
+static int loader_thread(void *arg)
+{
+    Decoder *dec = arg;
+    int ok = decoder_open(dec) == 0 && decoder_start(dec) == 0;
+
+    dec->ready_at = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&dec->ready, ok ? 1 : -1);
+
+    return 0;
+}
+
+static Decoder *decoder_new(Output *out, const char *path)
+{
+    Decoder *dec = calloc(1, sizeof(Decoder));
+    if (!dec) {
+        fprintf(stderr, "Could not allocate decoder\n");
+        return NULL;
     }
     else {
         /* nothing */
     }
 
-    if (avcodec_parameters_to_context(vcodec_ctx,
-            fmt_ctx->streams[video_stream]->codecpar) < 0) {
-        fprintf(stderr, "Could not copy video codec params\n");
-        goto cleanup;
+    dec->path = path;
+    dec->out = out;
+    dec->skip_until = AV_NOPTS_VALUE;
+    dec->audio_skip_until = -1.0;
+    dec->metrics = out->metrics;
+    metrics_init(&dec->audio, "audio");
+
+    return dec;
+}
+
+/* Open 'path' in the background; its threads time themselves into a
+ * Metrics of their own, added to the player's when the item is freed */
+static Decoder *decoder_load(Output *out, const char *path)
+{
+    Decoder *dec = decoder_new(out, path);
+    if (!dec) {
+        return NULL;
+    }
+    else {
+        metrics_init(&dec->preload, "preload");
+        dec->metrics = &dec->preload;
+    }
+
+    dec->loader = SDL_CreateThread(loader_thread, "loader", dec);
+    if (!dec->loader) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        SDL_AtomicSet(&dec->ready, -1);
     }
     else {
         /* nothing */
     }
 
-    if (avcodec_open2(vcodec_ctx, vcodec, NULL) < 0) {
-        fprintf(stderr, "Could not open video codec\n");
-        goto cleanup;
+    return dec;
+}
+
+/* Stop and free an item; the threads of an item before it in the
+ * playlist must be gone, since they may hand over to this one */
+static void decoder_free(Decoder *dec)
+{
+    if (!dec) {
+        return;
     }
     else {
         /* nothing */
     }
 
-    /* Set up audio decoder */
-    acodec = avcodec_find_decoder(
-        fmt_ctx->streams[audio_stream]->codecpar->codec_id);
-    if (!acodec) {
-        fprintf(stderr, "Unsupported audio codec\n");
-        goto cleanup;
+    if (dec->loader) {
+        SDL_WaitThread(dec->loader, NULL);
+        dec->loader = NULL;
     }
     else {
         /* nothing */
     }
 
-    acodec_ctx = avcodec_alloc_context3(acodec);
-    if (!acodec_ctx) {
-        fprintf(stderr, "Could not allocate audio codec context\n");
-        goto cleanup;
+    if (dec->demuxer || dec->video_decoder || dec->audio_decoder) {
+        decoder_abort(dec);
+        decoder_join(dec);
     }
     else {
         /* nothing */
     }
 
-    if (avcodec_parameters_to_context(acodec_ctx,
-            fmt_ctx->streams[audio_stream]->codecpar) < 0) {
-        fprintf(stderr, "Could not copy audio codec params\n");
-        goto cleanup;
+    dec->out->frames_skipped += dec->frames_skipped;
+    dec->out->frames_discarded += dec->frames_discarded;
+    if (dec->metrics != dec->out->metrics) {
+        metrics_merge(dec->out->metrics, dec->metrics);
     }
     else {
         /* nothing */
     }
+    metrics_merge(dec->out->metrics, &dec->audio);
 
-    if (avcodec_open2(acodec_ctx, acodec, NULL) < 0) {
-        fprintf(stderr, "Could not open audio codec\n");
-        goto cleanup;
+    packet_queue_destroy(&dec->videoq);
+    packet_queue_destroy(&dec->audioq);
+    frame_queue_destroy(&dec->queue);
+    kf_index_free(&dec->index);
+
+    if (dec->vcodec_ctx) {
+        avcodec_free_context(&dec->vcodec_ctx);
     }
     else {
         /* nothing */
     }
 
-    /* Set up audio resampler */
-    swr_ctx = swr_alloc_set_opts(NULL,
-        AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, SAMPLE_RATE,
-        acodec_ctx->channel_layout, acodec_ctx->sample_fmt,
-        acodec_ctx->sample_rate, 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not init resampler\n");
-        goto cleanup;
+    if (dec->acodec_ctx) {
+        avcodec_free_context(&dec->acodec_ctx);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (dec->fmt_ctx) {
+        avformat_close_input(&dec->fmt_ctx);
+    }
+    else {
+        /* nothing */
+    }
+
+    free(dec);
+}
+
+/*
+ * Render thread, once per pass: keep the item after 'cur' loading, drop
+ * one that failed to open and try the one after it, and publish it to
+ * cur's audio thread once it is ready. 'failed' counts failures in a row,
+ * so a looping playlist of broken items ends.
+ */
+static void playlist_poll(Playlist *pl, Output *out, Decoder *cur,
+    Decoder **next, int *failed)
+{
+    if (!*next && SDL_AtomicGet(&cur->chained)) {
+        const char *path = playlist_next(pl);
+
+        *next = decoder_load(out, path);
+        if (*next) {
+            SDL_AtomicSet(&(*next)->chained, playlist_more(pl));
+        }
+        else {
+            SDL_AtomicSet(&cur->chained, 0);
+        }
+    }
+    else if (*next && SDL_AtomicGet(&(*next)->ready) < 0) {
+        fprintf(stderr, "Skipping %s\n", (*next)->path);
+        decoder_free(*next);
+        *next = NULL;
+        if (++*failed >= pl->count || !playlist_more(pl)) {
+            SDL_AtomicSet(&cur->chained, 0);
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else if (*next && SDL_AtomicGet(&(*next)->ready) > 0 &&
+             !SDL_AtomicGetPtr((void **)&cur->next)) {
+        *failed = 0;
+        SDL_AtomicSetPtr((void **)&cur->next, *next);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+int main(void)
+{
+    AVFrame *frame = NULL;
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    Playlist playlist;
+    Output out;
+    Decoder *cur = NULL;
+    Decoder *next = NULL;
+    TexturePool pool;
+    FrameFormat ff;
+    YuvRgb rgb;
+    Metrics metrics;
+    int items = 1;
+    int failed = 0;
+    int seeks = 0;
+    int out_width = 0;
+    int out_height = 0;
+    int ret = 1;
+
+    SDL_memset(&out, 0, sizeof(out));
+    metrics_init(&metrics, "both_mp4");
+    SDL_memset(&pool, 0, sizeof(pool));
+    SDL_memset(&ff, 0, sizeof(ff));
+    out.pool = &pool;
+    out.metrics = &metrics;
+
+    if (playlist_load(&playlist, VIDEO_FILE) < 0) {
+        playlist_free(&playlist);
+        return 1;
     }
     else {
         /* nothing */
     }
 
+    /* The first item that opens is opened up front: the window and the
+     * audio device are set up for it. Items that do not open are skipped
+     * here as they are later on */
+    for (int tries = 0; !cur && tries < playlist.count; tries++) {
+        cur = decoder_new(&out, playlist_next(&playlist));
+        if (!cur) {
+            goto cleanup;
+        }
+        else if (decoder_open(cur) < 0) {
+            fprintf(stderr, "Skipping %s\n", cur->path);
+            decoder_free(cur);
+            cur = NULL;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (!cur) {
+        fprintf(stderr, "No playlist item could be opened\n");
+        goto cleanup;
+    }
+    else {
+        SDL_AtomicSet(&cur->chained, playlist_more(&playlist));
+    }
+
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
@@ -169,7 +1045,8 @@ int main(void)
     /* Create window */
     window = SDL_CreateWindow("A/V Player",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        vcodec_ctx->width, vcodec_ctx->height, 0);
+        cur->vcodec_ctx->width, cur->vcodec_ctx->height,
+        SDL_WINDOW_RESIZABLE);
     if (!window) {
         fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
         goto cleanup;
@@ -178,145 +1055,317 @@ int main(void)
         /* nothing */
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (!renderer) {
-        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
-        goto cleanup;
+    /* YUV_RGB converts into the window surface, which rules out a
+     * renderer on the same window; the surface is not scaled, so the
+     * window takes the video's size */
+    if (yuv_rgb_init(&rgb, window, cur->vcodec_ctx->height)) {
+        SDL_SetWindowSize(window, cur->vcodec_ctx->width,
+            cur->vcodec_ctx->height);
+        frame_format_init(&ff, NULL, cur->vcodec_ctx->thread_count);
     }
     else {
-        /* nothing */
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        if (!renderer) {
+            fprintf(stderr, "Could not create renderer: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* A texture in the decoder's own layout where SDL has one; a
+         * decoder that only knows once it decodes negotiates then */
+        frame_format_init(&ff, renderer, cur->vcodec_ctx->thread_count);
+        SDL_GetRendererOutputSize(renderer, &out_width, &out_height);
+        frame_format_set_output(&ff, out_width, out_height);
+        if (cur->vcodec_ctx->pix_fmt != AV_PIX_FMT_NONE &&
+            frame_format_open(&ff, cur->vcodec_ctx->pix_fmt,
+                frame_format_full_range(cur->vcodec_ctx->pix_fmt,
+                    cur->vcodec_ctx->color_range),
+                cur->vcodec_ctx->width, cur->vcodec_ctx->height) < 0) {
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Decode straight into locked textures where the renderer
+         * allows, unless every frame gets scaled down anyway; later
+         * items share them where their frames fit */
+        if (frame_format_scales(&ff, cur->vcodec_ctx->width,
+                cur->vcodec_ctx->height)) {
+            printf("Zero-copy decode: disabled (downscaling)\n");
+        }
+        else {
+            /* A playlist preloads the next item into the same pool */
+            texture_pool_init(&pool, renderer, cur->vcodec_ctx,
+                playlist.count > 1 || playlist.loop ? 2 : 1);
+        }
     }
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
-        SDL_TEXTUREACCESS_STREAMING, vcodec_ctx->width, vcodec_ctx->height);
-    if (!texture) {
-        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
+    /* Open audio device in the source's own format if it takes it; the
+     * callback stays silent until the device is unpaused. Later items
+     * are converted to whatever this opened with */
+    SDL_AudioSpec spec;
+    SDL_AudioSpec have;
+    audio_format_request(&spec, cur->acodec_ctx);
+    spec.samples = audio_latency_samples(spec.freq);
+    spec.callback = audio_ring_callback;
+    spec.userdata = &out.ring;
+
+    out.audio_dev = audio_format_open(&spec, &have);
+    if (!out.audio_dev) {
+        fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
         goto cleanup;
     }
     else {
         /* nothing */
     }
 
-    /* Open audio device */
-    SDL_AudioSpec spec;
-    spec.freq = SAMPLE_RATE;
-    spec.format = AUDIO_S16LSB;
-    spec.channels = CHANNELS;
-    spec.samples = 1024;
-    spec.callback = NULL;
-
-    audio_dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
-    if (!audio_dev) {
-        fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
+    if (audio_format_init(&out.af, &have, cur->acodec_ctx) < 0) {
         goto cleanup;
     }
     else {
         /* nothing */
     }
 
-    /* Allocate frame and packet */
-    frame = av_frame_alloc();
-    packet = av_packet_alloc();
-    if (!frame || !packet) {
-        fprintf(stderr, "Could not allocate frame/packet\n");
+    /* About a second of audio or AUDIO_LATENCY_MS, refilled once it
+     * drops below half */
+    int ring_size = audio_latency_ring(out.af.rate, out.af.frame_size,
+        have.samples, out.af.bytes_per_second);
+    if (audio_ring_init(&out.ring, ring_size, ring_size / 2,
+            out.af.frame_size) < 0) {
+        fprintf(stderr, "Could not allocate audio ring\n");
         goto cleanup;
     }
     else {
         /* nothing */
     }
 
+    out.ring.silence = have.silence;
+
     /* Start audio */
-    SDL_PauseAudioDevice(audio_dev, 0);
+    SDL_PauseAudioDevice(out.audio_dev, 0);
+
+    /* Start decode threads */
+    out.clock_offset = -(SDL_GetTicks() / 1000.0);
+    out.clock_mutex = SDL_CreateMutex();
+    if (!out.clock_mutex) {
+        fprintf(stderr, "Could not create mutex: %s\n", SDL_GetError());
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
 
-    /* Get time bases */
-    double video_tb = av_q2d(fmt_ctx->streams[video_stream]->time_base);
-    double audio_tb = av_q2d(fmt_ctx->streams[audio_stream]->time_base);
+    if (decoder_start(cur) < 0 || decoder_start_audio(cur) < 0) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
 
-    /* Main loop */
+    /* Main loop: present queued frames at their deadline */
     SDL_Event event;
     int quit = 0;
-    Uint32 start_time = SDL_GetTicks();
-    (void)audio_tb;
-
-    while (!quit && av_read_frame(fmt_ctx, packet) >= 0) {
-        if (packet->stream_index == video_stream) {
-            if (avcodec_send_packet(vcodec_ctx, packet) >= 0) {
-                while (avcodec_receive_frame(vcodec_ctx, frame) >= 0) {
-                    /* Calculate frame PTS in seconds */
-                    double pts = frame->pts * video_tb;
-
-                    /* Wait for audio to catch up */
-                    double audio_pos = (double)(SDL_GetTicks() - start_time) /
-                        1000.0;
-                    double delay = pts - audio_pos;
-                    if (delay > 0.001) {
-                        SDL_Delay((Uint32)(delay * 1000));
-                    }
-                    else {
-                        /* no delay needed */
-                    }
+    double av_offset = 0.0;
+    double av_offset_max = 0.0;
+    int frames_dropped = 0;
+    int late_streak = 0;
+    int on_time_streak = 0;
+    Uint64 seek_start = 0;
 
-                    /* Display frame */
-                    SDL_UpdateYUVTexture(texture, NULL,
-                        frame->data[0], frame->linesize[0],
-                        frame->data[1], frame->linesize[1],
-                        frame->data[2], frame->linesize[2]);
+    while (!quit) {
+        double delay = 0.0;
 
-                    SDL_RenderClear(renderer);
-                    SDL_RenderCopy(renderer, texture, NULL, NULL);
-                    SDL_RenderPresent(renderer);
-                }
+        playlist_poll(&playlist, &out, cur, &next, &failed);
+
+        /* Out of frames: the last item is over, or the next one takes
+         * the screen once its audio has taken over the device; until
+         * then the last frame stays up */
+        if (frame_queue_done(&cur->queue) &&
+            !SDL_AtomicGet(&cur->chained)) {
+            break;
+        }
+        else if (frame_queue_done(&cur->queue) && next &&
+                 SDL_AtomicGet(&next->audio_live) < 0) {
+            quit = 1;
+            break;
+        }
+        else if (frame_queue_done(&cur->queue) && next &&
+                 SDL_AtomicGet(&next->audio_live) > 0) {
+            Uint64 now = SDL_GetPerformanceCounter();
+
+            printf("Playlist: %s, ready %.1f ms before it was due\n",
+                next->path, (double)(Sint64)(now - next->ready_at) *
+                    1000.0 / SDL_GetPerformanceFrequency());
+
+            decoder_free(cur);
+            cur = next;
+            next = NULL;
+            items++;
+
+            if (rgb.window) {
+                SDL_SetWindowSize(window, cur->vcodec_ctx->width,
+                    cur->vcodec_ctx->height);
             }
             else {
-                /* decode error */
+                /* nothing */
             }
         }
-        else if (packet->stream_index == audio_stream) {
-            if (avcodec_send_packet(acodec_ctx, packet) >= 0) {
-                while (avcodec_receive_frame(acodec_ctx, frame) >= 0) {
-                    /* Calculate output size */
-                    int out_samples = swr_get_out_samples(swr_ctx,
-                        frame->nb_samples);
-                    int needed_size = out_samples * CHANNELS * 2;
-
-                    if (needed_size > audio_buffer_size) {
-                        free(audio_buffer);
-                        audio_buffer = malloc(needed_size);
-                        audio_buffer_size = needed_size;
-                    }
-                    else {
-                        /* buffer is big enough */
-                    }
+        else {
+            /* nothing */
+        }
 
-                    /* Resample */
-                    uint8_t *out_planes[] = { audio_buffer };
-                    int converted = swr_convert(swr_ctx, out_planes,
-                        out_samples,
-                        (const uint8_t **)frame->data, frame->nb_samples);
+        frame = frame_queue_peek(&cur->queue);
+        if (frame && metrics.bench) {
+            /* Bench mode shows every frame as soon as it is decoded */
+        }
+        else if (frame && frame_queue_time(frame) == AV_NOPTS_VALUE) {
+            /* Nothing to schedule on: show it as it comes */
+        }
+        else if (frame) {
+            /* Frame time in playlist time against the clock */
+            double pts = cur->offset +
+                frame_queue_time(frame) * cur->video_tb;
+            delay = pts - master_clock(&out);
+        }
+        else {
+            /* nothing */
+        }
 
-                    if (converted > 0) {
-                        SDL_QueueAudio(audio_dev, audio_buffer,
-                            converted * CHANNELS * 2);
-                    }
-                    else {
-                        /* nothing */
-                    }
+        if (frame && delay < -DROP_THRESHOLD) {
+            /* Too late to be worth showing: skip the upload and present */
+            frame_queue_next(&cur->queue);
+            frames_dropped++;
+            on_time_streak = 0;
 
-                    /* Limit queue size to avoid memory buildup */
-                    while (SDL_GetQueuedAudioSize(audio_dev) > SAMPLE_RATE * 4) {
-                        SDL_Delay(10);
-                    }
+            /* Sustained lateness: have the decoder skip frames too */
+            int level = SDL_AtomicGet(&out.skip_frame);
+            if (++late_streak >= DROP_ESCALATE &&
+                level + 1 < (int)SDL_arraysize(discard_levels)) {
+                SDL_AtomicSet(&out.skip_frame, level + 1);
+                late_streak = 0;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else if (frame && delay <= 0.001) {
+            /* Back on time for a while: relax the decoder discard */
+            int level = SDL_AtomicGet(&out.skip_frame);
+            late_streak = 0;
+            if (++on_time_streak >= DROP_RELAX && level > 0) {
+                SDL_AtomicSet(&out.skip_frame, level - 1);
+                on_time_streak = 0;
+            }
+            else {
+                /* nothing */
+            }
+
+            /* Positive offset = video ahead of audio */
+            av_offset = delay;
+            if (SDL_fabs(av_offset) > SDL_fabs(av_offset_max)) {
+                av_offset_max = av_offset;
+            }
+            else {
+                /* nothing */
+            }
+
+            /* Display frame */
+            Uint64 t = metrics_begin();
+
+            if (rgb.window) {
+                /* Convert into the window surface in the stream's own
+                 * colours; unlabelled HD is taken to be BT.709 */
+                int matrix = frame->colorspace == AVCOL_SPC_BT709 ||
+                    (frame->colorspace == AVCOL_SPC_UNSPECIFIED &&
+                     frame->height >= 720) ? 709 : 601;
+                int full_range = frame->color_range == AVCOL_RANGE_JPEG ||
+                    frame->format == AV_PIX_FMT_YUVJ420P;
+
+                if (matrix != rgb.matrix || full_range != rgb.full_range) {
+                    yuv_rgb_set_matrix(&rgb, matrix, full_range);
+                }
+                else {
+                    /* nothing */
+                }
+
+                AVFrame *i420 = frame_format_i420(&ff, frame);
+
+                if (i420) {
+                    yuv_rgb_convert(&rgb, i420->data[0], i420->linesize[0],
+                        i420->data[1], i420->linesize[1],
+                        i420->data[2], i420->linesize[2],
+                        i420->width, i420->height);
+                }
+                else {
+                    /* nothing */
+                }
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_UpdateWindowSurface(window);
+            }
+            else {
+                /* A pooled texture is full size: one that gets scaled
+                 * down is left locked for the pool to recycle */
+                TextureSlot *slot = frame_format_scales(&ff, frame->width,
+                    frame->height) ? NULL : texture_pool_slot(&pool, frame);
+                SDL_Texture *shown = NULL;
+                SDL_Rect src = { 0, 0, frame->width, frame->height };
+
+                if (slot) {
+                    /* Decoded in place: unlocking uploads it */
+                    shown = texture_pool_present(slot);
                 }
+                else {
+                    shown = frame_format_upload(&ff, frame);
+                }
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_RenderClear(renderer);
+                if (shown) {
+                    /* Pooled textures are padded past the frame */
+                    SDL_RenderCopy(renderer, shown, slot ? &src : NULL,
+                        NULL);
+                }
+                else {
+                    /* nothing */
+                }
+                SDL_RenderPresent(renderer);
+            }
+            metrics_end(&metrics, METRICS_PRESENT, t);
+            metrics_frame(&metrics);
+
+            /* Seek latency: key press to the target frame on screen */
+            if (seek_start) {
+                printf("Seek to %.3f s: %.1f ms\n",
+                    cur->offset + frame_queue_time(frame) * cur->video_tb,
+                    (double)(SDL_GetPerformanceCounter() - seek_start) *
+                        1000.0 / SDL_GetPerformanceFrequency());
+                seek_start = 0;
             }
             else {
-                /* decode error */
+                /* nothing */
             }
+
+            frame_queue_next(&cur->queue);
+        }
+        else if (frame) {
+            /* Sleep until the frame is due */
+            SDL_Delay(delay < 0.010 ? (Uint32)(delay * 1000) : 10);
         }
         else {
-            /* other stream */
+            /* Decoder has not caught up yet */
+            SDL_Delay(1);
         }
 
-        av_packet_unref(packet);
+        /* Hand textures the decoder is done with back to it */
+        texture_pool_recycle(&pool);
+
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
 
         /* Handle events */
         while (SDL_PollEvent(&event)) {
@@ -327,98 +1376,180 @@ int main(void)
                      event.key.keysym.sym == SDLK_ESCAPE) {
                 quit = 1;
             }
+            else if (event.type == SDL_WINDOWEVENT &&
+                     event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED &&
+                     renderer) {
+                /* The next upload reallocates the texture to fit */
+                SDL_GetRendererOutputSize(renderer, &out_width,
+                    &out_height);
+                frame_format_set_output(&ff, out_width, out_height);
+            }
+            else if (event.type == SDL_KEYDOWN &&
+                     (event.key.keysym.sym == SDLK_LEFT ||
+                      event.key.keysym.sym == SDLK_RIGHT ||
+                      event.key.keysym.sym == SDLK_DOWN ||
+                      event.key.keysym.sym == SDLK_UP ||
+                      event.key.keysym.sym == SDLK_HOME)) {
+                SDL_Keycode sym = event.key.keysym.sym;
+                double position = master_clock(&out);
+                double target = sym == SDLK_LEFT ? position - SEEK_SHORT :
+                    sym == SDLK_RIGHT ? position + SEEK_SHORT :
+                    sym == SDLK_DOWN ? position - SEEK_LONG :
+                    sym == SDLK_UP ? position + SEEK_LONG : cur->offset;
+
+                /* Left/Right 5 s, Down/Up 60 s, Home to the start of
+                 * the item; not once the next item's audio is playing */
+                if (!decoder_hold(cur)) {
+                    /* nothing */
+                }
+                else {
+                    seek_start = SDL_GetPerformanceCounter();
+                    seeks++;
+                    if (decoder_seek(cur, target) < 0) {
+                        quit = 1;
+                    }
+                    else {
+                        /* nothing */
+                    }
+                }
+            }
             else {
                 /* ignore */
             }
         }
     }
 
-    /* Wait for audio to finish */
-    while (SDL_GetQueuedAudioSize(audio_dev) > 0) {
-        SDL_Delay(10);
+    /* Let the audio decoder finish unless the user quit; the next
+     * item may already be writing to the ring */
+    if (quit) {
+        decoder_abort(cur);
+        if (next) {
+            decoder_abort(next);
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
     }
 
-    ret = 0;
-
-cleanup:
-    if (audio_buffer) {
-        free(audio_buffer);
+    if (cur->audio_decoder) {
+        SDL_WaitThread(cur->audio_decoder, NULL);
+        cur->audio_decoder = NULL;
     }
     else {
         /* nothing */
     }
 
-    if (packet) {
-        av_packet_free(&packet);
+    /* Wait for audio to finish */
+    audio_ring_finish(&out.ring);
+    while (audio_ring_fill(&out.ring) >= out.af.frame_size) {
+        SDL_Delay(10);
+    }
+    SDL_Delay(1000 * have.samples / have.freq);
+
+    printf("A/V offset: last %.1f ms, max %.1f ms\n",
+        av_offset * 1000.0, av_offset_max * 1000.0);
+    audio_latency_report(&out.ring, out.af.bytes_per_second, &metrics);
+    metrics_audio(&metrics, (Uint64)(audio_ring_played(&out.ring,
+        out.af.bytes_per_second) / out.af.frame_size));
+
+    if (playlist.count > 1 || playlist.loop) {
+        printf("Playlist: %d items played\n", items);
     }
     else {
         /* nothing */
     }
 
-    if (frame) {
-        av_frame_free(&frame);
+    ret = 0;
+
+cleanup:
+    /* The current item's audio thread may be handing over to the next
+     * one: stop it before the next one goes */
+    if (cur) {
+        decoder_abort(cur);
+        decoder_join(cur);
     }
     else {
         /* nothing */
     }
 
-    if (swr_ctx) {
-        swr_free(&swr_ctx);
+    decoder_free(next);
+    decoder_free(cur);
+
+    /* Only counted in full once every item is freed */
+    if (ret == 0) {
+        printf("Dropped frames: %d late, %d skipped by decoder "
+            "(discard %s)\n", frames_dropped, out.frames_discarded,
+            discard_names[SDL_AtomicGet(&out.skip_frame)]);
     }
     else {
         /* nothing */
     }
 
-    if (texture) {
-        SDL_DestroyTexture(texture);
+    if (ret == 0 && seeks > 0) {
+        printf("Seeks: %d, %d frames decoded but not shown\n", seeks,
+            out.frames_skipped);
     }
     else {
         /* nothing */
     }
 
-    if (renderer) {
-        SDL_DestroyRenderer(renderer);
+    if (ret == 0) {
+        metrics_report(&metrics);
     }
     else {
         /* nothing */
     }
 
-    if (window) {
-        SDL_DestroyWindow(window);
+    if (pool.count > 0) {
+        printf("Zero-copy decode: %d frames copied instead\n",
+            SDL_AtomicGet(&pool.misses));
     }
     else {
         /* nothing */
     }
 
-    if (audio_dev) {
-        SDL_CloseAudioDevice(audio_dev);
+    texture_pool_destroy(&pool);
+
+    if (out.clock_mutex) {
+        SDL_DestroyMutex(out.clock_mutex);
     }
     else {
         /* nothing */
     }
 
-    SDL_Quit();
+    audio_format_free(&out.af);
+
+    frame_format_destroy(&ff);
 
-    if (vcodec_ctx) {
-        avcodec_free_context(&vcodec_ctx);
+    if (renderer) {
+        SDL_DestroyRenderer(renderer);
     }
     else {
         /* nothing */
     }
 
-    if (acodec_ctx) {
-        avcodec_free_context(&acodec_ctx);
+    if (window) {
+        SDL_DestroyWindow(window);
     }
     else {
         /* nothing */
     }
 
-    if (fmt_ctx) {
-        avformat_close_input(&fmt_ctx);
+    if (out.audio_dev) {
+        SDL_CloseAudioDevice(out.audio_dev);
     }
     else {
         /* nothing */
     }
 
+    audio_ring_destroy(&out.ring);
+
+    SDL_Quit();
+
+    playlist_free(&playlist);
+
     return ret;
 }
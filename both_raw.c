@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <SDL2/SDL.h>
+#include "audio_latency.h"
+#include "audio_ring.h"
+#include "frame_source.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "yuv_rgb.h"
 
 #define VIDEO_FILE   "video.yuv"
 #define AUDIO_FILE   "audio.pcm"
@@ -9,37 +15,59 @@
 #define FPS          30
 #define SAMPLE_RATE  44100
 #define CHANNELS     2
-#define BUFFER_SIZE  4096
+#define SEEK_SHORT   5.0
+#define SEEK_LONG    60.0
+#define WAIT_MAX_MS  100
+
+/* Restart both streams at 'seconds', audio at the first sample of the
+ * frame shown there; returns that frame */
+static long seek(Prefetch *prefetch, SDL_AudioDeviceID audio_dev, double fps,
+    double seconds)
+{
+    long index = seconds > 0.0 ? (long)(seconds * fps) : 0;
+    Sint64 sample = (Sint64)((Sint64)index * SAMPLE_RATE / fps);
+
+    SDL_ClearQueuedAudio(audio_dev);
+    prefetch_seek(prefetch, index, sample * CHANNELS * 2);
+
+    return index;
+}
 
-int main(void)
+int main(int argc, char **argv)
 {
-    FILE *video_fp = NULL;
+    FrameSource video;
+    AudioRing audio_ring;
+    Prefetch prefetch;
+    YuvRgb rgb;
+    Metrics metrics;
     FILE *audio_fp = NULL;
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
     SDL_Texture *texture = NULL;
     SDL_AudioDeviceID audio_dev = 0;
-    unsigned char *y_plane = NULL;
-    unsigned char *u_plane = NULL;
-    unsigned char *v_plane = NULL;
+    const unsigned char *y_plane = NULL;
+    const unsigned char *u_plane = NULL;
+    const unsigned char *v_plane = NULL;
     unsigned char *audio_buffer = NULL;
+    const char *path = argc > 1 ? argv[1] : VIDEO_FILE;
     int ret = 1;
 
-    /* Calculate sizes */
-    int y_size = WIDTH * HEIGHT;
-    int uv_size = (WIDTH / 2) * (HEIGHT / 2);
-    int bytes_per_frame = (SAMPLE_RATE * CHANNELS * 2) / FPS;
+    SDL_memset(&audio_ring, 0, sizeof(audio_ring));
+    SDL_memset(&prefetch, 0, sizeof(prefetch));
+    metrics_init(&metrics, "both_raw");
 
-    /* Open files */
-    video_fp = fopen(VIDEO_FILE, "rb");
-    if (!video_fp) {
-        fprintf(stderr, "Could not open %s\n", VIDEO_FILE);
+    /* Open files; a Y4M header overrides the built-in geometry */
+    if (frame_source_open(&video, path, WIDTH, HEIGHT, FPS) < 0) {
         return 1;
     }
     else {
         /* nothing */
     }
 
+    /* Calculate sizes: a frame's worth of audio, rounded up */
+    double fps = frame_source_fps(&video);
+    int bytes_per_frame = ((int)(SAMPLE_RATE / fps) + 1) * CHANNELS * 2;
+
     audio_fp = fopen(AUDIO_FILE, "rb");
     if (!audio_fp) {
         fprintf(stderr, "Could not open %s\n", AUDIO_FILE);
@@ -49,12 +77,11 @@ int main(void)
         /* nothing */
     }
 
-    /* Allocate buffers */
-    y_plane = malloc(y_size);
-    u_plane = malloc(uv_size);
-    v_plane = malloc(uv_size);
+    /* Allocate buffers, PREFETCH_AUDIO_MS of PCM read ahead */
+    int ring_size = prefetch_audio_bytes(SAMPLE_RATE * CHANNELS * 2);
     audio_buffer = malloc(bytes_per_frame);
-    if (!y_plane || !u_plane || !v_plane || !audio_buffer) {
+    if (!audio_buffer || audio_ring_init(&audio_ring, ring_size,
+            ring_size / 2, CHANNELS * 2) < 0) {
         fprintf(stderr, "Could not allocate buffers\n");
         goto cleanup;
     }
@@ -62,6 +89,14 @@ int main(void)
         /* nothing */
     }
 
+    /* Read both files ahead of the render loop on an I/O thread */
+    if (prefetch_start(&prefetch, &video, audio_fp, &audio_ring) < 0) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
@@ -74,7 +109,7 @@ int main(void)
     /* Create window */
     window = SDL_CreateWindow("A/V Player",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WIDTH, HEIGHT, 0);
+        video.width, video.height, 0);
     if (!window) {
         fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
         goto cleanup;
@@ -83,23 +118,32 @@ int main(void)
         /* nothing */
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (!renderer) {
-        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
-        goto cleanup;
-    }
-    else {
+    /* YUV_RGB converts into the window surface, which rules out a
+     * renderer on the same window */
+    if (yuv_rgb_init(&rgb, window, video.height)) {
         /* nothing */
     }
-
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
-        SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
-    if (!texture) {
-        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
-        goto cleanup;
-    }
     else {
-        /* nothing */
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        if (!renderer) {
+            fprintf(stderr, "Could not create renderer: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
+            SDL_TEXTUREACCESS_STREAMING, video.width, video.height);
+        if (!texture) {
+            fprintf(stderr, "Could not create texture: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
     }
 
     /* Open audio device */
@@ -107,7 +151,7 @@ int main(void)
     spec.freq = SAMPLE_RATE;
     spec.format = AUDIO_S16LSB;
     spec.channels = CHANNELS;
-    spec.samples = 1024;
+    spec.samples = audio_latency_samples(SAMPLE_RATE);
     spec.callback = NULL;
 
     audio_dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
@@ -124,21 +168,35 @@ int main(void)
 
     /* Main loop */
     SDL_Event event;
+    int have_event = 0;
+    int repaint = 0;
     int quit = 0;
     Uint32 start_time = SDL_GetTicks();
-    int frame_num = 0;
+    long frame_num = 0;
 
     while (!quit) {
         /* Calculate expected frame based on elapsed time */
         Uint32 elapsed = SDL_GetTicks() - start_time;
-        int expected_frame = (elapsed * FPS) / 1000;
+        long expected_frame = (long)(elapsed * fps / 1000.0);
+        long first_frame = frame_num;
+        Uint64 t;
 
-        /* Display frames to catch up */
+        /* Bench mode takes exactly one new frame per pass */
+        if (metrics.bench) {
+            expected_frame = frame_num;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Catch up: audio for every frame, but only the newest frame's
+         * video, which sits at a known offset in the mapping */
         while (frame_num <= expected_frame) {
-            /* Read video frame */
-            if (fread(y_plane, 1, y_size, video_fp) != (size_t)y_size ||
-                fread(u_plane, 1, uv_size, video_fp) != (size_t)uv_size ||
-                fread(v_plane, 1, uv_size, video_fp) != (size_t)uv_size) {
+            t = metrics_begin();
+
+            if (frame_num == expected_frame &&
+                prefetch_get(&prefetch, frame_num, &y_plane, &u_plane,
+                    &v_plane) < 0) {
                 quit = 1;
                 break;
             }
@@ -146,11 +204,18 @@ int main(void)
                 /* nothing */
             }
 
-            /* Read corresponding audio */
-            size_t audio_read = fread(audio_buffer, 1, bytes_per_frame,
-                audio_fp);
+            /* Read corresponding audio, exact over a run of frames even
+             * when a frame is not a whole number of samples */
+            long samples =
+                (long)((Sint64)(frame_num + 1) * SAMPLE_RATE / fps) -
+                (long)((Sint64)frame_num * SAMPLE_RATE / fps);
+            int audio_read = prefetch_read_audio(&prefetch, audio_buffer,
+                samples * CHANNELS * 2);
+            t = metrics_end(&metrics, METRICS_READ, t);
             if (audio_read > 0) {
                 SDL_QueueAudio(audio_dev, audio_buffer, audio_read);
+                metrics_end(&metrics, METRICS_QUEUE, t);
+                metrics_audio(&metrics, audio_read / (CHANNELS * 2));
             }
             else {
                 /* nothing */
@@ -159,21 +224,62 @@ int main(void)
             frame_num++;
         }
 
-        /* Update display with latest frame */
-        SDL_UpdateYUVTexture(texture, NULL,
-            y_plane, WIDTH,
-            u_plane, WIDTH / 2,
-            v_plane, WIDTH / 2);
+        /* Update display with latest frame, only when there is a new one
+         * or the window lost what it showed */
+        if (y_plane && (frame_num > first_frame || repaint)) {
+            t = metrics_begin();
+            if (rgb.window) {
+                yuv_rgb_convert(&rgb, y_plane, video.width,
+                    u_plane, video.chroma_width, v_plane, video.chroma_width,
+                    video.width, video.height);
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_UpdateWindowSurface(window);
+                metrics_end(&metrics, METRICS_PRESENT, t);
+            }
+            else {
+                SDL_UpdateYUVTexture(texture, NULL,
+                    y_plane, video.width,
+                    u_plane, video.chroma_width,
+                    v_plane, video.chroma_width);
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_RenderClear(renderer);
+                SDL_RenderCopy(renderer, texture, NULL, NULL);
+                SDL_RenderPresent(renderer);
+                metrics_end(&metrics, METRICS_PRESENT, t);
+            }
+            repaint = 0;
+        }
+        else {
+            /* nothing */
+        }
+
+        if (frame_num > first_frame) {
+            metrics_frame(&metrics);
+        }
+        else {
+            /* nothing */
+        }
 
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
+        /* Sleep until the next frame is due or an event comes in; bench
+         * mode only looks for events */
+        if (metrics.bench) {
+            have_event = SDL_PollEvent(&event);
+        }
+        else {
+            Sint32 wait = (Sint32)(start_time +
+                (Uint32)SDL_ceil(frame_num * 1000.0 / fps) - SDL_GetTicks());
+
+            have_event = SDL_WaitEventTimeout(&event,
+                wait <= 0 ? 0 : wait < WAIT_MAX_MS ? wait : WAIT_MAX_MS);
+        }
 
-        /* Small delay to avoid busy loop */
-        SDL_Delay(1);
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
 
         /* Handle events */
-        while (SDL_PollEvent(&event)) {
+        while (have_event) {
             if (event.type == SDL_QUIT) {
                 quit = 1;
             }
@@ -181,9 +287,34 @@ int main(void)
                      event.key.keysym.sym == SDLK_ESCAPE) {
                 quit = 1;
             }
+            else if (event.type == SDL_KEYDOWN &&
+                     (event.key.keysym.sym == SDLK_LEFT ||
+                      event.key.keysym.sym == SDLK_RIGHT ||
+                      event.key.keysym.sym == SDLK_DOWN ||
+                      event.key.keysym.sym == SDLK_UP ||
+                      event.key.keysym.sym == SDLK_HOME)) {
+                SDL_Keycode sym = event.key.keysym.sym;
+                double now = frame_num / fps;
+                double target = sym == SDLK_LEFT ? now - SEEK_SHORT :
+                    sym == SDLK_RIGHT ? now + SEEK_SHORT :
+                    sym == SDLK_DOWN ? now - SEEK_LONG :
+                    sym == SDLK_UP ? now + SEEK_LONG : 0.0;
+
+                /* Left/Right 5 s, Down/Up 60 s, Home to the start */
+                frame_num = seek(&prefetch, audio_dev, fps, target);
+                start_time = SDL_GetTicks() -
+                    (Uint32)(frame_num * 1000.0 / fps);
+            }
+            else if (event.type == SDL_WINDOWEVENT &&
+                     (event.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                      event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+                repaint = 1;
+            }
             else {
                 /* ignore other events */
             }
+
+            have_event = SDL_PollEvent(&event);
         }
     }
 
@@ -192,29 +323,14 @@ int main(void)
         SDL_Delay(10);
     }
 
+    prefetch_report(&prefetch);
+    metrics_report(&metrics);
+
     ret = 0;
 
 cleanup:
-    if (y_plane) {
-        free(y_plane);
-    }
-    else {
-        /* nothing */
-    }
-
-    if (u_plane) {
-        free(u_plane);
-    }
-    else {
-        /* nothing */
-    }
-
-    if (v_plane) {
-        free(v_plane);
-    }
-    else {
-        /* nothing */
-    }
+    prefetch_stop(&prefetch);
+    audio_ring_destroy(&audio_ring);
 
     if (audio_buffer) {
         free(audio_buffer);
@@ -253,12 +369,7 @@ cleanup:
 
     SDL_Quit();
 
-    if (video_fp) {
-        fclose(video_fp);
-    }
-    else {
-        /* nothing */
-    }
+    frame_source_close(&video);
 
     if (audio_fp) {
         fclose(audio_fp);
@@ -0,0 +1,140 @@
+#ifndef DECODE_THREADS_H
+#define DECODE_THREADS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+
+/* libavcodec gains little from more threads than this */
+#define DECODE_THREADS_MAX  16
+
+/*
+ * Decoder threading is chosen at runtime:
+ *   DECODE_THREADS      thread count, 0 or unset = auto
+ *   DECODE_THREAD_TYPE  "frame", "slice" or unset = let libavcodec pick
+ *   PLAYER_INSTANCES    players sharing this host, unset = count them
+ * Auto splits the host's cores evenly between running players.
+ */
+
+/* Running MP4 players on this host (including this one), via /proc */
+static int decode_threads_instances(void)
+{
+    const char *env = getenv("PLAYER_INSTANCES");
+    DIR *dir;
+    struct dirent *entry;
+    int count = 0;
+
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+    else {
+        /* nothing */
+    }
+
+    dir = opendir("/proc");
+    if (!dir) {
+        return 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[64];
+        char comm[32];
+        FILE *fp;
+
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        else {
+            /* nothing */
+        }
+
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        else {
+            /* nothing */
+        }
+
+        if (fgets(comm, sizeof(comm), fp) &&
+            (strcmp(comm, "video_mp4.exe\n") == 0 ||
+             strcmp(comm, "both_mp4.exe\n") == 0)) {
+            count++;
+        }
+        else {
+            /* nothing */
+        }
+
+        fclose(fp);
+    }
+
+    closedir(dir);
+
+    return count > 0 ? count : 1;
+}
+
+/* Set thread_count/thread_type on 'ctx'; call before avcodec_open2 */
+static void decode_threads_configure(AVCodecContext *ctx)
+{
+    const char *count_env = getenv("DECODE_THREADS");
+    const char *type_env = getenv("DECODE_THREAD_TYPE");
+    int count = count_env ? atoi(count_env) : 0;
+
+    if (count <= 0) {
+        count = SDL_GetCPUCount() / decode_threads_instances();
+    }
+    else {
+        /* nothing */
+    }
+
+    if (count < 1) {
+        count = 1;
+    }
+    else if (count > DECODE_THREADS_MAX) {
+        count = DECODE_THREADS_MAX;
+    }
+    else {
+        /* nothing */
+    }
+
+    ctx->thread_count = count;
+
+    if (type_env && strcmp(type_env, "frame") == 0) {
+        ctx->thread_type = FF_THREAD_FRAME;
+    }
+    else if (type_env && strcmp(type_env, "slice") == 0) {
+        ctx->thread_type = FF_THREAD_SLICE;
+    }
+    else {
+        ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+}
+
+/* Print what the opened decoder actually runs with */
+static void decode_threads_report(AVCodecContext *ctx)
+{
+    const char *type = "single";
+
+    if (ctx->active_thread_type & FF_THREAD_FRAME) {
+        type = "frame";
+    }
+    else if (ctx->active_thread_type & FF_THREAD_SLICE) {
+        type = "slice";
+    }
+    else {
+        /* nothing */
+    }
+
+    printf("Decoder: %s, %d %s thread(s) (%d cores, %d instances)\n",
+        ctx->codec->name, ctx->thread_count, type, SDL_GetCPUCount(),
+        decode_threads_instances());
+}
+
+#endif
@@ -0,0 +1,493 @@
+#ifndef FRAME_FORMAT_H
+#define FRAME_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+/*
+ * Decoded frames go to SDL in the decoder's own layout whenever SDL has a
+ * texture format for it: I420 as IYUV, NV12/NV21 as themselves, packed
+ * 4:2:2 as YUY2/UYVY/YVYU. Anything else (planar 4:2:2 and 4:4:4, high
+ * bit depth) is converted to I420 by a swscale context that is made on
+ * the first such frame, runs on the decoder's thread count, and is kept
+ * until the input format or size changes.
+ *
+ * Frames larger than the display are brought down to it before the
+ * upload, at decode time through the codec's lowres where the decoder
+ * has one, else by the same swscale context; the texture follows the
+ * window size. DOWNSCALE=0 keeps full resolution.
+ *
+ * SDL shows YUV textures as limited range, so full-range (JPEG) frames
+ * never go to a texture as they are: swscale squeezes them into limited
+ * range I420 on the way. The YUV_RGB path converts full range itself and
+ * gets the source's range unchanged.
+ */
+typedef struct {
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    Uint32 sdl_format;
+    int av_format;
+    int width;
+    int height;
+    int out_width;
+    int out_height;
+    int texture_width;
+    int texture_height;
+    int full_range;
+    int threads;
+    struct SwsContext *sws;
+    int sws_format;
+    int sws_squeeze;
+    int sws_width;
+    int sws_height;
+    int sws_out_width;
+    int sws_out_height;
+    AVFrame *converted;
+    long conversions;
+} FrameFormat;
+
+/* SDL texture format holding 'format' as it is, or UNKNOWN */
+static Uint32 frame_format_native(int format)
+{
+    switch (format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return SDL_PIXELFORMAT_IYUV;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+    case AV_PIX_FMT_NV12:
+        return SDL_PIXELFORMAT_NV12;
+    case AV_PIX_FMT_NV21:
+        return SDL_PIXELFORMAT_NV21;
+#endif
+    case AV_PIX_FMT_YUYV422:
+        return SDL_PIXELFORMAT_YUY2;
+    case AV_PIX_FMT_UYVY422:
+        return SDL_PIXELFORMAT_UYVY;
+    case AV_PIX_FMT_YVYU422:
+        return SDL_PIXELFORMAT_YVYU;
+    default:
+        return SDL_PIXELFORMAT_UNKNOWN;
+    }
+}
+
+/* 1 if 'format' tagged with 'range' holds full-range YUV */
+static int frame_format_full_range(int format, int range)
+{
+    return range == AVCOL_RANGE_JPEG || format == AV_PIX_FMT_YUVJ420P ||
+        format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P;
+}
+
+/* I420 that keeps the source's range, so swscale does not rescale it;
+ * for the YUV_RGB path only, textures always get limited range */
+static int frame_format_i420_of(int format)
+{
+    if (format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P) {
+        return AV_PIX_FMT_YUVJ420P;
+    }
+    else {
+        return AV_PIX_FMT_YUV420P;
+    }
+}
+
+static int frame_format_downscale(void)
+{
+    const char *env = getenv("DOWNSCALE");
+
+    return !env || strcmp(env, "0") != 0;
+}
+
+/* Largest codec lowres (a 2^n reduction) that still covers 'out_width'
+ * x 'out_height'; set it before avcodec_open2 */
+static int frame_format_lowres(const AVCodec *codec, int width, int height,
+    int out_width, int out_height)
+{
+    int lowres = 0;
+
+    if (!frame_format_downscale()) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (lowres < codec->max_lowres &&
+           (width >> (lowres + 1)) >= out_width &&
+           (height >> (lowres + 1)) >= out_height) {
+        lowres++;
+    }
+
+    if (lowres > 0) {
+        printf("Lowres decode: %dx%d at 1/%d, %dx%d\n", width, height,
+            1 << lowres, width >> lowres, height >> lowres);
+    }
+    else {
+        /* nothing */
+    }
+
+    return lowres;
+}
+
+static void frame_format_init(FrameFormat *ff, SDL_Renderer *renderer,
+    int threads)
+{
+    SDL_memset(ff, 0, sizeof(*ff));
+    ff->renderer = renderer;
+    ff->threads = threads > 0 ? threads : 1;
+    ff->av_format = AV_PIX_FMT_NONE;
+    ff->sws_format = AV_PIX_FMT_NONE;
+}
+
+/* Largest size frames are uploaded at, in pixels; 0 x 0 for none.
+ * Call it again when the window size changes */
+static void frame_format_set_output(FrameFormat *ff, int width, int height)
+{
+    if (frame_format_downscale()) {
+        ff->out_width = width;
+        ff->out_height = height;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* The size a width x height frame is uploaded at: its own, or scaled
+ * down by one factor for both sides (the smaller of the two ratios) to
+ * fit the output without changing its shape, rounded down to even for
+ * the I420 chroma planes */
+static void frame_format_target(FrameFormat *ff, int width, int height,
+    int *out_width, int *out_height)
+{
+    *out_width = width;
+    *out_height = height;
+
+    if (ff->out_width <= 0 || ff->out_height <= 0 ||
+        (width <= ff->out_width && height <= ff->out_height)) {
+        return;
+    }
+    else if ((Sint64)ff->out_width * height <=
+             (Sint64)ff->out_height * width) {
+        /* Width is the tighter fit */
+        *out_width = ff->out_width;
+        *out_height = (int)((Sint64)height * ff->out_width / width);
+    }
+    else {
+        *out_width = (int)((Sint64)width * ff->out_height / height);
+        *out_height = ff->out_height;
+    }
+
+    *out_width = *out_width > 2 ? *out_width & ~1 : 2;
+    *out_height = *out_height > 2 ? *out_height & ~1 : 2;
+}
+
+/* 1 if a width x height frame is larger than the output and gets
+ * scaled down */
+static int frame_format_scales(FrameFormat *ff, int width, int height)
+{
+    int out_width;
+    int out_height;
+
+    frame_format_target(ff, width, height, &out_width, &out_height);
+
+    return out_width != width || out_height != height;
+}
+
+/* (Re)make the converter from 'format' at width x height to I420 at
+ * out_width x out_height, with 'squeeze' from full to limited range;
+ * it is kept for as long as none of them changes */
+static int frame_format_sws(FrameFormat *ff, int format, int squeeze,
+    int width, int height, int out_width, int out_height)
+{
+    int i420 = squeeze ? AV_PIX_FMT_YUV420P : frame_format_i420_of(format);
+    int scaled = out_width != width || out_height != height;
+
+    if (ff->sws && ff->sws_format == format &&
+        ff->sws_squeeze == squeeze && ff->sws_width == width &&
+        ff->sws_height == height && ff->sws_out_width == out_width &&
+        ff->sws_out_height == out_height) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (ff->sws) {
+        sws_freeContext(ff->sws);
+        ff->sws = NULL;
+    }
+    else {
+        /* nothing */
+    }
+    av_frame_free(&ff->converted);
+    ff->sws_format = AV_PIX_FMT_NONE;
+
+    ff->sws = sws_alloc_context();
+    ff->converted = av_frame_alloc();
+    if (!ff->sws || !ff->converted) {
+        fprintf(stderr, "Could not allocate pixel format converter\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Same size in and out takes swscale's unscaled fast paths; area
+     * averaging keeps a large downscale from aliasing */
+    av_opt_set_int(ff->sws, "srcw", width, 0);
+    av_opt_set_int(ff->sws, "srch", height, 0);
+    av_opt_set_int(ff->sws, "src_format", format, 0);
+    av_opt_set_int(ff->sws, "dstw", out_width, 0);
+    av_opt_set_int(ff->sws, "dsth", out_height, 0);
+    av_opt_set_int(ff->sws, "dst_format", i420, 0);
+    av_opt_set_int(ff->sws, "sws_flags", scaled ? SWS_AREA : SWS_POINT, 0);
+    if (squeeze) {
+        /* A range change leaves the unscaled copy paths for the
+         * converting one */
+        av_opt_set_int(ff->sws, "src_range", 1, 0);
+        av_opt_set_int(ff->sws, "dst_range", 0, 0);
+    }
+    else {
+        /* nothing */
+    }
+    /* Slice threads exist from libswscale 6 on; older ones ignore this */
+    av_opt_set_int(ff->sws, "threads", ff->threads, 0);
+
+    if (sws_init_context(ff->sws, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not convert %s to %s\n",
+            av_get_pix_fmt_name(format), av_get_pix_fmt_name(i420));
+        sws_freeContext(ff->sws);
+        ff->sws = NULL;
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    ff->converted->format = i420;
+    ff->converted->width = out_width;
+    ff->converted->height = out_height;
+    if (av_frame_get_buffer(ff->converted, 0) < 0) {
+        fprintf(stderr, "Could not allocate converted frame\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    ff->sws_format = format;
+    ff->sws_squeeze = squeeze;
+    ff->sws_width = width;
+    ff->sws_height = height;
+    ff->sws_out_width = out_width;
+    ff->sws_out_height = out_height;
+
+    return 0;
+}
+
+/* 'frame' as I420 at width x height, in 'limited' range or its own:
+ * itself, or converted through the cached context */
+static AVFrame *frame_format_convert(FrameFormat *ff, AVFrame *frame,
+    int width, int height, int limited)
+{
+    int squeeze = limited &&
+        frame_format_full_range(frame->format, frame->color_range);
+
+    if ((frame->format == AV_PIX_FMT_YUV420P ||
+         frame->format == AV_PIX_FMT_YUVJ420P) && !squeeze &&
+        frame->width == width && frame->height == height) {
+        return frame;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (frame_format_sws(ff, frame->format, squeeze, frame->width,
+            frame->height, width, height) < 0) {
+        return NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    sws_scale(ff->sws, (const uint8_t *const *)frame->data, frame->linesize,
+        0, frame->height, ff->converted->data, ff->converted->linesize);
+    ff->converted->pts = frame->pts;
+    ff->converted->colorspace = frame->colorspace;
+    ff->converted->color_range = squeeze ? AVCOL_RANGE_MPEG :
+        frame->color_range;
+    ff->conversions++;
+
+    return ff->converted;
+}
+
+/* 'frame' as I420 at its own size and in its own range */
+static AVFrame *frame_format_i420(FrameFormat *ff, AVFrame *frame)
+{
+    return frame_format_convert(ff, frame, frame->width, frame->height, 0);
+}
+
+/* Pick the texture for the decoder's 'format' at width x height, full
+ * range or not, and make it; -1 if even the I420 fallback cannot be
+ * created */
+static int frame_format_open(FrameFormat *ff, int format, int full_range,
+    int width, int height)
+{
+    int texture_width;
+    int texture_height;
+    Uint32 native;
+    Uint32 sdl_format;
+
+    frame_format_target(ff, width, height, &texture_width, &texture_height);
+
+    /* Scaling and full range go through swscale, which writes I420 */
+    native = texture_width == width && texture_height == height &&
+        !full_range ? frame_format_native(format) : SDL_PIXELFORMAT_UNKNOWN;
+    sdl_format = native != SDL_PIXELFORMAT_UNKNOWN ?
+        native : SDL_PIXELFORMAT_IYUV;
+
+    if (ff->texture) {
+        SDL_DestroyTexture(ff->texture);
+        ff->texture = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    ff->texture = SDL_CreateTexture(ff->renderer, sdl_format,
+        SDL_TEXTUREACCESS_STREAMING, texture_width, texture_height);
+    if (!ff->texture && sdl_format != SDL_PIXELFORMAT_IYUV) {
+        /* The renderer turned the native format down: convert after all */
+        native = SDL_PIXELFORMAT_UNKNOWN;
+        sdl_format = SDL_PIXELFORMAT_IYUV;
+        ff->texture = SDL_CreateTexture(ff->renderer, sdl_format,
+            SDL_TEXTUREACCESS_STREAMING, texture_width, texture_height);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (!ff->texture) {
+        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    ff->sdl_format = sdl_format;
+    ff->av_format = format;
+    ff->full_range = full_range;
+    ff->width = width;
+    ff->height = height;
+    ff->texture_width = texture_width;
+    ff->texture_height = texture_height;
+
+    if (native != SDL_PIXELFORMAT_UNKNOWN) {
+        printf("Pixel format: %s into %s texture\n",
+            av_get_pix_fmt_name(format), SDL_GetPixelFormatName(sdl_format));
+    }
+    else {
+        printf("Pixel format: %s %dx%d converted to %s %dx%d%s "
+            "(%d threads) into %s texture\n", av_get_pix_fmt_name(format),
+            width, height, av_get_pix_fmt_name(AV_PIX_FMT_YUV420P),
+            texture_width, texture_height,
+            full_range ? " limited range" : "", ff->threads,
+            SDL_GetPixelFormatName(sdl_format));
+    }
+
+    return 0;
+}
+
+/* Upload 'frame' into the texture, renegotiating it if the decoder's
+ * output or the output size changed; returns the texture, NULL if
+ * nothing could be shown */
+static SDL_Texture *frame_format_upload(FrameFormat *ff, AVFrame *frame)
+{
+    int width;
+    int height;
+    int full_range = frame_format_full_range(frame->format,
+        frame->color_range);
+
+    frame_format_target(ff, frame->width, frame->height, &width, &height);
+
+    if (frame->format != ff->av_format || frame->width != ff->width ||
+        frame->height != ff->height || width != ff->texture_width ||
+        height != ff->texture_height || full_range != ff->full_range) {
+        if (frame_format_open(ff, frame->format, full_range, frame->width,
+                frame->height) < 0) {
+            return NULL;
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    if (ff->sdl_format == SDL_PIXELFORMAT_NV12 ||
+        ff->sdl_format == SDL_PIXELFORMAT_NV21) {
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+        SDL_UpdateNVTexture(ff->texture, NULL,
+            frame->data[0], frame->linesize[0],
+            frame->data[1], frame->linesize[1]);
+#endif
+    }
+    else if (ff->sdl_format != SDL_PIXELFORMAT_IYUV) {
+        /* Packed 4:2:2: one plane */
+        SDL_UpdateTexture(ff->texture, NULL, frame->data[0],
+            frame->linesize[0]);
+    }
+    else {
+        AVFrame *i420 = frame_format_convert(ff, frame, width, height, 1);
+
+        if (!i420) {
+            return NULL;
+        }
+        else {
+            /* nothing */
+        }
+
+        SDL_UpdateYUVTexture(ff->texture, NULL,
+            i420->data[0], i420->linesize[0],
+            i420->data[1], i420->linesize[1],
+            i420->data[2], i420->linesize[2]);
+    }
+
+    return ff->texture;
+}
+
+static void frame_format_destroy(FrameFormat *ff)
+{
+    if (ff->texture) {
+        SDL_DestroyTexture(ff->texture);
+        ff->texture = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (ff->sws) {
+        sws_freeContext(ff->sws);
+        ff->sws = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    av_frame_free(&ff->converted);
+
+    if (ff->conversions > 0) {
+        printf("Pixel format: %ld frames converted\n", ff->conversions);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+#endif
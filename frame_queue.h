@@ -0,0 +1,172 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <SDL2/SDL.h>
+#include <libavutil/frame.h>
+
+/* Decoded frames buffered between decode and render threads (power of 2) */
+#define FRAME_QUEUE_SIZE  8
+
+/*
+ * Single-producer/single-consumer ring of ref-counted frames. The indices
+ * are free-running and only ever written by their owning side, so neither
+ * side takes a lock; the producer sleeps on 'space' when the ring is full.
+ */
+typedef struct {
+    AVFrame *frames[FRAME_QUEUE_SIZE];
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    SDL_atomic_t finished;
+    SDL_atomic_t abort;
+    SDL_sem *space;
+} FrameQueue;
+
+/* A decoded frame's time in its stream's time base: the decoder's best
+ * guess, which covers frames without a PTS, else the PTS itself */
+static int64_t frame_queue_time(const AVFrame *frame)
+{
+    return frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+        frame->best_effort_timestamp : frame->pts;
+}
+
+static int frame_queue_init(FrameQueue *q)
+{
+    SDL_memset(q, 0, sizeof(*q));
+
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        q->frames[i] = av_frame_alloc();
+        if (!q->frames[i]) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    q->space = SDL_CreateSemaphore(FRAME_QUEUE_SIZE);
+    if (!q->space) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+static void frame_queue_destroy(FrameQueue *q)
+{
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        if (q->frames[i]) {
+            av_frame_free(&q->frames[i]);
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (q->space) {
+        SDL_DestroySemaphore(q->space);
+        q->space = NULL;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Producer: move 'src' into the ring, waiting for space; -1 on abort */
+static int frame_queue_push(FrameQueue *q, AVFrame *src)
+{
+    while (SDL_SemWaitTimeout(q->space, 10) == SDL_MUTEX_TIMEDOUT) {
+        if (SDL_AtomicGet(&q->abort)) {
+            return -1;
+        }
+        else {
+            /* keep waiting */
+        }
+    }
+
+    if (SDL_AtomicGet(&q->abort)) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    int w = SDL_AtomicGet(&q->write);
+    av_frame_move_ref(q->frames[w & (FRAME_QUEUE_SIZE - 1)], src);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&q->write, w + 1);
+
+    return 0;
+}
+
+/* Producer: no more frames will follow */
+static void frame_queue_finish(FrameQueue *q)
+{
+    SDL_AtomicSet(&q->finished, 1);
+}
+
+/* Consumer: oldest queued frame, or NULL if the ring is empty */
+static AVFrame *frame_queue_peek(FrameQueue *q)
+{
+    int r = SDL_AtomicGet(&q->read);
+
+    if (r == SDL_AtomicGet(&q->write)) {
+        return NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    SDL_MemoryBarrierAcquire();
+
+    return q->frames[r & (FRAME_QUEUE_SIZE - 1)];
+}
+
+/* Consumer: release the frame returned by frame_queue_peek */
+static void frame_queue_next(FrameQueue *q)
+{
+    int r = SDL_AtomicGet(&q->read);
+
+    av_frame_unref(q->frames[r & (FRAME_QUEUE_SIZE - 1)]);
+    SDL_AtomicSet(&q->read, r + 1);
+    SDL_SemPost(q->space);
+}
+
+/* Consumer: nothing queued and nothing more coming */
+static int frame_queue_done(FrameQueue *q)
+{
+    return SDL_AtomicGet(&q->finished) &&
+        SDL_AtomicGet(&q->read) == SDL_AtomicGet(&q->write);
+}
+
+/* Both sides stopped (after a seek): drop every queued frame and start
+ * over empty */
+static void frame_queue_reset(FrameQueue *q)
+{
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        av_frame_unref(q->frames[i]);
+    }
+
+    while (SDL_SemTryWait(q->space) == 0) {
+        /* nothing */
+    }
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        SDL_SemPost(q->space);
+    }
+
+    SDL_AtomicSet(&q->read, 0);
+    SDL_AtomicSet(&q->write, 0);
+    SDL_AtomicSet(&q->finished, 0);
+    SDL_AtomicSet(&q->abort, 0);
+}
+
+/* Either side: wake and stop the producer */
+static void frame_queue_abort(FrameQueue *q)
+{
+    SDL_AtomicSet(&q->abort, 1);
+    SDL_SemPost(q->space);
+}
+
+#endif
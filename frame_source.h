@@ -0,0 +1,401 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Frames kept resident ahead of the playhead */
+#define FRAME_SOURCE_WINDOW  8
+
+/* Longest stream or FRAME header line we accept */
+#define Y4M_HEADER_MAX  1024
+
+/*
+ * Memory-mapped planar 4:2:0 video: headerless I420, or a YUV4MPEG2
+ * stream whose header supplies geometry, frame rate, chroma siting and
+ * interlacing. Frames are handed out as pointers into the mapping, so the
+ * texture upload reads straight from the page cache.
+ *
+ * Y4M frames are located by walking their FRAME markers, lazily and only
+ * a window ahead of the playhead; the payload offsets found so far form
+ * an index, so frames already walked can be revisited in O(1).
+ */
+typedef struct {
+    int fd;
+    unsigned char *base;
+    size_t map_size;
+    int width;
+    int height;
+    int chroma_width;
+    int fps_num;
+    int fps_den;
+    char interlace;
+    char chroma[16];
+    size_t y_size;
+    size_t uv_size;
+    size_t frame_size;
+    long frame_count;
+    long window_start;
+    long window_end;
+    int y4m;
+    int indexed_all;
+    size_t *offsets;
+    long offsets_cap;
+} FrameSource;
+
+/* Parse the YUV4MPEG2 stream header; returns the payload start or 0 */
+static size_t frame_source_y4m_header(FrameSource *src)
+{
+    const char *p = (const char *)src->base + 10;
+    const char *end = memchr(src->base, '\n',
+        src->map_size < Y4M_HEADER_MAX ? src->map_size : Y4M_HEADER_MAX);
+
+    if (!end) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Y4M defaults for tags the header leaves out */
+    src->width = 0;
+    src->height = 0;
+    src->interlace = 'p';
+    strcpy(src->chroma, "420jpeg");
+
+    while (p < end) {
+        const char *tag_end = p;
+        size_t len;
+
+        while (tag_end < end && *tag_end != ' ') {
+            tag_end++;
+        }
+        len = (size_t)(tag_end - p);
+
+        if (len > 1 && *p == 'W') {
+            src->width = atoi(p + 1);
+        }
+        else if (len > 1 && *p == 'H') {
+            src->height = atoi(p + 1);
+        }
+        else if (len > 1 && *p == 'F') {
+            sscanf(p + 1, "%d:%d", &src->fps_num, &src->fps_den);
+        }
+        else if (len > 1 && *p == 'I') {
+            src->interlace = p[1];
+        }
+        else if (len > 1 && *p == 'C' && len - 1 < sizeof(src->chroma)) {
+            memcpy(src->chroma, p + 1, len - 1);
+            src->chroma[len - 1] = '\0';
+        }
+        else {
+            /* aspect ratio, comments and extensions do not matter here */
+        }
+
+        p = tag_end + 1;
+    }
+
+    return (size_t)(end - (const char *)src->base) + 1;
+}
+
+/* Y4M: walk FRAME markers until frame 'index' is known or the file ends */
+static void frame_source_index(FrameSource *src, long index)
+{
+    while (!src->indexed_all && src->frame_count <= index) {
+        size_t pos = src->offsets[src->frame_count];
+        const unsigned char *marker = src->base + pos;
+        size_t avail = src->map_size - pos;
+        const unsigned char *eol;
+
+        /* The entry past the last frame holds where its marker starts */
+        if (avail < 6 || memcmp(marker, "FRAME", 5) != 0 ||
+            !(eol = memchr(marker, '\n',
+                avail < Y4M_HEADER_MAX ? avail : Y4M_HEADER_MAX)) ||
+            (size_t)(eol + 1 - src->base) + src->frame_size >
+                src->map_size) {
+            src->indexed_all = 1;
+            break;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Room for this payload and the next marker position */
+        if (src->frame_count + 2 > src->offsets_cap) {
+            long cap = src->offsets_cap * 2;
+            size_t *grown = realloc(src->offsets, cap * sizeof(size_t));
+            if (!grown) {
+                src->indexed_all = 1;
+                break;
+            }
+            else {
+                src->offsets = grown;
+                src->offsets_cap = cap;
+            }
+        }
+        else {
+            /* nothing */
+        }
+
+        pos = (size_t)(eol + 1 - src->base);
+        src->offsets[src->frame_count] = pos;
+        src->offsets[src->frame_count + 1] = pos + src->frame_size;
+        src->frame_count++;
+    }
+}
+
+/* Byte offset of frame 'index' (which must already be known) */
+static size_t frame_source_offset(FrameSource *src, long index)
+{
+    if (src->y4m) {
+        return src->offsets[index];
+    }
+    else {
+        return (size_t)index * src->frame_size;
+    }
+}
+
+static void frame_source_close(FrameSource *src)
+{
+    if (src->base) {
+        munmap(src->base, src->map_size);
+        src->base = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (src->fd >= 0) {
+        close(src->fd);
+        src->fd = -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    free(src->offsets);
+    src->offsets = NULL;
+}
+
+/* Map 'path'; a Y4M header overrides the given width, height and fps */
+static int frame_source_open(FrameSource *src, const char *path,
+    int width, int height, int fps)
+{
+    struct stat st;
+    size_t payload = 0;
+
+    memset(src, 0, sizeof(*src));
+    src->fd = -1;
+    src->width = width;
+    src->height = height;
+    src->fps_num = fps;
+    src->fps_den = 1;
+    src->interlace = 'p';
+    strcpy(src->chroma, "420");
+
+    src->fd = open(path, O_RDONLY);
+    if (src->fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (fstat(src->fd, &st) < 0) {
+        fprintf(stderr, "Could not stat %s\n", path);
+        close(src->fd);
+        src->fd = -1;
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (st.st_size == 0) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Map it all; a headerless file ignores a trailing partial frame */
+    src->map_size = (size_t)st.st_size;
+    src->base = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE,
+        src->fd, 0);
+    if (src->base == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        src->base = NULL;
+        close(src->fd);
+        src->fd = -1;
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    madvise(src->base, src->map_size, MADV_SEQUENTIAL);
+
+    if (src->map_size >= 10 && memcmp(src->base, "YUV4MPEG2 ", 10) == 0) {
+        src->y4m = 1;
+        payload = frame_source_y4m_header(src);
+        if (payload == 0 || src->width <= 0 || src->height <= 0) {
+            fprintf(stderr, "Bad Y4M header in %s\n", path);
+            frame_source_close(src);
+            return -1;
+        }
+        else if (strcmp(src->chroma, "420") != 0 &&
+                 strcmp(src->chroma, "420jpeg") != 0 &&
+                 strcmp(src->chroma, "420mpeg2") != 0 &&
+                 strcmp(src->chroma, "420paldv") != 0) {
+            /* These differ only in chroma siting; anything else (4:2:2,
+             * 4:4:4, mono, high bit depth) is not an 8-bit I420 layout */
+            fprintf(stderr, "Unsupported Y4M chroma %s in %s (need 4:2:0)\n",
+                src->chroma, path);
+            frame_source_close(src);
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    if (src->fps_num <= 0 || src->fps_den <= 0) {
+        src->fps_num = fps;
+        src->fps_den = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Y4M rounds odd chroma dimensions up, raw I420 always has been
+     * read with them rounded down */
+    src->chroma_width = src->y4m ? (src->width + 1) / 2 : src->width / 2;
+    src->y_size = (size_t)src->width * src->height;
+    src->uv_size = (size_t)src->chroma_width *
+        (src->y4m ? (src->height + 1) / 2 : src->height / 2);
+    src->frame_size = src->y_size + 2 * src->uv_size;
+
+    if (src->y4m) {
+        src->offsets_cap = 2 * FRAME_SOURCE_WINDOW;
+        src->offsets = malloc(src->offsets_cap * sizeof(size_t));
+        if (!src->offsets) {
+            fprintf(stderr, "Could not allocate frame index\n");
+            frame_source_close(src);
+            return -1;
+        }
+        else {
+            src->offsets[0] = payload;
+        }
+
+        printf("%s: Y4M %dx%d, %d/%d fps, %s, %s\n", path, src->width,
+            src->height, src->fps_num, src->fps_den, src->chroma,
+            src->interlace == 'p' ? "progressive" : "interlaced");
+    }
+    else {
+        src->frame_count = (long)(src->map_size / src->frame_size);
+        src->indexed_all = 1;
+    }
+
+    return 0;
+}
+
+/* Frames per second, from the stream header or the caller's default */
+static double frame_source_fps(FrameSource *src)
+{
+    return (double)src->fps_num / src->fps_den;
+}
+
+/* Move the resident window so that it starts at frame 'index' */
+static void frame_source_advise(FrameSource *src, long index)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    long end = index + FRAME_SOURCE_WINDOW;
+
+    if (end > src->frame_count) {
+        end = src->frame_count;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Only issue syscalls once the playhead crossed half the window */
+    if (index >= src->window_start &&
+        index < src->window_start + FRAME_SOURCE_WINDOW / 2 &&
+        src->window_end > src->window_start) {
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Drop the pages behind the playhead (rounded to whole pages) */
+    if (index > src->window_start) {
+        size_t from = frame_source_offset(src, src->window_start) /
+            page * page;
+        size_t to = frame_source_offset(src, index) / page * page;
+        if (to > from) {
+            madvise(src->base + from, to - from, MADV_DONTNEED);
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Ask for the frames ahead of it */
+    if (end > index) {
+        size_t from = frame_source_offset(src, index) / page * page;
+        size_t to = frame_source_offset(src, end - 1) + src->frame_size;
+        madvise(src->base + from, to - from, MADV_WILLNEED);
+    }
+    else {
+        /* nothing */
+    }
+
+    src->window_start = index;
+    src->window_end = end;
+}
+
+/* Point y/u/v at frame 'index'; returns -1 past the end of the file */
+static int frame_source_get(FrameSource *src, long index,
+    const unsigned char **y, const unsigned char **u,
+    const unsigned char **v)
+{
+    if (index < 0) {
+        return -1;
+    }
+    else if (src->y4m) {
+        frame_source_index(src, index + FRAME_SOURCE_WINDOW - 1);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (index >= src->frame_count) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    frame_source_advise(src, index);
+
+    *y = src->base + frame_source_offset(src, index);
+    *u = *y + src->y_size;
+    *v = *u + src->uv_size;
+
+    return 0;
+}
+
+#endif
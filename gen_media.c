@@ -0,0 +1,735 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+
+#define VIDEO_YUV    "video.yuv"
+#define AUDIO_PCM    "audio.pcm"
+#define VIDEO_MP4    "video.mp4"
+#define AUDIO_MP4    "audio.mp4"
+#define SAMPLE_RATE  44100
+#define CHANNELS     2
+
+/* Audio: a steady tone, replaced by a louder tick at every whole second;
+ * the video flashes a marker on the same frames, for A/V sync checks */
+#define TONE_HZ      440
+#define TICK_HZ      1000
+#define TICK_MS      50
+#define TONE_LEVEL   8192
+#define TICK_LEVEL   24576
+
+/* Frame counter digits, in units of one segment thickness */
+#define DIGITS       6
+#define DIGIT_W      5
+#define DIGIT_H      9
+#define DIGIT_PITCH  7
+
+/*
+ * Test inputs for the players. Everything is computed with integer
+ * arithmetic only, so the raw YUV and PCM files are bit-identical on every
+ * host; the MP4s are as reproducible as the local encoders allow (fixed
+ * settings, one encoder thread).
+ */
+typedef struct {
+    int width;
+    int height;
+    int fps;
+    int seconds;
+    int moving;
+} MediaParams;
+
+typedef struct {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *vcodec_ctx;
+    AVCodecContext *acodec_ctx;
+    AVStream *vstream;
+    AVStream *astream;
+    AVFrame *vframe;
+    AVFrame *aframe;
+    AVPacket *packet;
+    SwrContext *swr_ctx;
+    int16_t *pcm;
+    int frame_size;
+    int64_t audio_next;
+    int64_t audio_total;
+} Mp4Writer;
+
+/* Seven-segment digits: bit 0..6 = segments a..g */
+static const unsigned char digit_segments[10] = {
+    0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F
+};
+
+/* Segment rectangles a..g: x, y, w, h within a DIGIT_W x DIGIT_H cell */
+static const unsigned char segment_rects[7][4] = {
+    { 0, 0, 5, 1 }, { 4, 0, 1, 5 }, { 4, 4, 1, 5 }, { 0, 8, 5, 1 },
+    { 0, 4, 1, 5 }, { 0, 0, 1, 5 }, { 0, 4, 5, 1 }
+};
+
+/* 75% colour bars (Y, U, V), for the static pattern */
+static const unsigned char color_bars[8][3] = {
+    { 180, 128, 128 }, { 168,  44, 136 }, { 145, 147,  44 },
+    { 133,  63,  52 }, {  63, 193, 204 }, {  51, 109, 212 },
+    {  28, 212, 120 }, {  16, 128, 128 }
+};
+
+static void fill_plane_rect(uint8_t *plane, int stride, int plane_w,
+    int plane_h, int x, int y, int w, int h, uint8_t value)
+{
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + w > plane_w ? plane_w : x + w;
+    int y1 = y + h > plane_h ? plane_h : y + h;
+
+    for (int row = y0; row < y1; row++) {
+        if (x1 > x0) {
+            memset(plane + (size_t)row * stride + x0, value, x1 - x0);
+        }
+        else {
+            /* nothing */
+        }
+    }
+}
+
+/* Fill a rectangle (in luma pixels) in all three I420 planes */
+static void fill_rect(uint8_t *planes[3], const int strides[3],
+    const MediaParams *params, int x, int y, int w, int h,
+    const unsigned char yuv[3])
+{
+    fill_plane_rect(planes[0], strides[0], params->width, params->height,
+        x, y, w, h, yuv[0]);
+
+    for (int i = 1; i < 3; i++) {
+        fill_plane_rect(planes[i], strides[i], params->width / 2,
+            params->height / 2, x / 2, y / 2, (w + 1) / 2, (h + 1) / 2,
+            yuv[i]);
+    }
+}
+
+/* Draw frame 'index' into I420 planes */
+static void draw_frame(const MediaParams *params, long index,
+    uint8_t *planes[3], const int strides[3])
+{
+    static const unsigned char black[3] = { 16, 128, 128 };
+    static const unsigned char white[3] = { 235, 128, 128 };
+    static const unsigned char box[3] = { 160, 60, 200 };
+    int width = params->width;
+    int height = params->height;
+    int unit = height / 60 > 2 ? height / 60 : 2;
+
+    /* Background: a scrolling gradient, or fixed colour bars */
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = planes[0] + (size_t)y * strides[0];
+
+        for (int x = 0; x < width; x++) {
+            if (params->moving) {
+                row[x] = (uint8_t)(x + 2 * y + 4 * index);
+            }
+            else {
+                row[x] = color_bars[x * 8 / width][0];
+            }
+        }
+    }
+
+    for (int y = 0; y < height / 2; y++) {
+        uint8_t *u = planes[1] + (size_t)y * strides[1];
+        uint8_t *v = planes[2] + (size_t)y * strides[2];
+
+        for (int x = 0; x < width / 2; x++) {
+            if (params->moving) {
+                u[x] = (uint8_t)(96 + ((2 * x + index) & 63));
+                v[x] = (uint8_t)(96 + ((2 * y - index) & 63));
+            }
+            else {
+                u[x] = color_bars[x * 16 / width][1];
+                v[x] = color_bars[x * 16 / width][2];
+            }
+        }
+    }
+
+    /* A box bouncing left and right across the middle */
+    if (params->moving) {
+        int size = (height / 6) & ~1;
+        int travel = width - size;
+        long pos = travel > 0 ? (index * 8) % (2 * travel) : 0;
+
+        if (pos > travel) {
+            pos = 2 * travel - pos;
+        }
+        else {
+            /* nothing */
+        }
+
+        fill_rect(planes, strides, params, (int)pos & ~1,
+            (height / 2 - size / 2) & ~1, size, size, box);
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Frame counter in the top-left corner */
+    fill_rect(planes, strides, params, 0, 0,
+        (DIGITS * DIGIT_PITCH + 1) * unit, (DIGIT_H + 2) * unit, black);
+
+    long value = index;
+    for (int d = DIGITS - 1; d >= 0; d--) {
+        unsigned char segments = digit_segments[value % 10];
+        int cell_x = (1 + d * DIGIT_PITCH) * unit;
+
+        for (int s = 0; s < 7; s++) {
+            if (segments & (1 << s)) {
+                fill_plane_rect(planes[0], strides[0], width, height,
+                    cell_x + segment_rects[s][0] * unit,
+                    unit + segment_rects[s][1] * unit,
+                    segment_rects[s][2] * unit,
+                    segment_rects[s][3] * unit, white[0]);
+            }
+            else {
+                /* nothing */
+            }
+        }
+
+        value /= 10;
+    }
+
+    /* Sync marker on the first frame of every second */
+    if (index % params->fps == 0) {
+        int size = 8 * unit;
+
+        fill_rect(planes, strides, params, width - size - 2 * unit,
+            height - size - 2 * unit, size, size, white);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Interleaved S16 stereo for sample frames [first, first + count) */
+static void draw_audio(int16_t *out, int64_t first, int count)
+{
+    const uint32_t tone_step =
+        (uint32_t)(((uint64_t)TONE_HZ << 32) / SAMPLE_RATE);
+    const uint32_t tick_step =
+        (uint32_t)(((uint64_t)TICK_HZ << 32) / SAMPLE_RATE);
+
+    for (int i = 0; i < count; i++) {
+        int64_t n = first + i;
+        int tick = n % SAMPLE_RATE < SAMPLE_RATE * TICK_MS / 1000;
+        uint32_t phase = (uint32_t)((uint64_t)n *
+            (tick ? tick_step : tone_step));
+        int level = tick ? TICK_LEVEL : TONE_LEVEL;
+
+        /* Triangle wave from the top 16 bits of the phase */
+        int v = (int)(phase >> 16);
+        int triangle = v < 32768 ? 2 * v - 32768 : 2 * (65535 - v) - 32768;
+        int16_t sample = (int16_t)(triangle * level / 32768);
+
+        for (int c = 0; c < CHANNELS; c++) {
+            out[i * CHANNELS + c] = sample;
+        }
+    }
+}
+
+static int write_yuv(const MediaParams *params)
+{
+    int strides[3] = { params->width, params->width / 2, params->width / 2 };
+    size_t y_size = (size_t)params->width * params->height;
+    size_t uv_size = y_size / 4;
+    long frames = (long)params->fps * params->seconds;
+    uint8_t *buffer = malloc(y_size + 2 * uv_size);
+    FILE *fp = NULL;
+    int ret = -1;
+
+    if (!buffer) {
+        fprintf(stderr, "Could not allocate frame\n");
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    fp = fopen(VIDEO_YUV, "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not create %s\n", VIDEO_YUV);
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    uint8_t *planes[3] = { buffer, buffer + y_size, buffer + y_size + uv_size };
+    for (long i = 0; i < frames; i++) {
+        draw_frame(params, i, planes, strides);
+        if (fwrite(buffer, 1, y_size + 2 * uv_size, fp) !=
+                y_size + 2 * uv_size) {
+            fprintf(stderr, "Could not write %s\n", VIDEO_YUV);
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    printf("%s: %dx%d I420, %d fps, %ld frames\n", VIDEO_YUV,
+        params->width, params->height, params->fps, frames);
+    ret = 0;
+
+cleanup:
+    if (fp) {
+        fclose(fp);
+    }
+    else {
+        /* nothing */
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+static int write_pcm(const MediaParams *params)
+{
+    int16_t buffer[4096 * CHANNELS];
+    int64_t total = (int64_t)SAMPLE_RATE * params->seconds;
+    FILE *fp = fopen(AUDIO_PCM, "wb");
+
+    if (!fp) {
+        fprintf(stderr, "Could not create %s\n", AUDIO_PCM);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int64_t n = 0; n < total; n += 4096) {
+        int count = total - n < 4096 ? (int)(total - n) : 4096;
+
+        draw_audio(buffer, n, count);
+        if (fwrite(buffer, CHANNELS * 2, count, fp) != (size_t)count) {
+            fprintf(stderr, "Could not write %s\n", AUDIO_PCM);
+            fclose(fp);
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    fclose(fp);
+    printf("%s: S16LE, %d Hz, %d channels, %d s\n", AUDIO_PCM,
+        SAMPLE_RATE, CHANNELS, params->seconds);
+
+    return 0;
+}
+
+/* Send one frame (NULL = flush) and mux whatever packets come out */
+static int mp4_encode(Mp4Writer *w, AVCodecContext *ctx, AVStream *stream,
+    AVFrame *frame)
+{
+    int ret = avcodec_send_frame(ctx, frame);
+
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(ctx, w->packet);
+        if (ret >= 0) {
+            av_packet_rescale_ts(w->packet, ctx->time_base,
+                stream->time_base);
+            w->packet->stream_index = stream->index;
+            ret = av_interleaved_write_frame(w->fmt_ctx, w->packet);
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static int mp4_add_video(Mp4Writer *w, const MediaParams *params)
+{
+    /* H.264 if the build has it, else the always-present MPEG-4 Part 2 */
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (!codec) {
+        fprintf(stderr, "No video encoder available\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    w->vstream = avformat_new_stream(w->fmt_ctx, NULL);
+    w->vcodec_ctx = avcodec_alloc_context3(codec);
+    w->vframe = av_frame_alloc();
+    if (!w->vstream || !w->vcodec_ctx || !w->vframe) {
+        fprintf(stderr, "Could not allocate video encoder\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    AVCodecContext *ctx = w->vcodec_ctx;
+    ctx->width = params->width;
+    ctx->height = params->height;
+    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    ctx->time_base = (AVRational){ 1, params->fps };
+    ctx->framerate = (AVRational){ params->fps, 1 };
+    ctx->gop_size = params->fps;
+    ctx->max_b_frames = 2;
+    ctx->bit_rate = (int64_t)params->width * params->height *
+        params->fps / 4;
+    ctx->thread_count = 1;
+    if (w->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (avcodec_open2(ctx, codec, NULL) < 0 ||
+        avcodec_parameters_from_context(w->vstream->codecpar, ctx) < 0) {
+        fprintf(stderr, "Could not open video encoder %s\n", codec->name);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    w->vstream->time_base = ctx->time_base;
+
+    w->vframe->format = ctx->pix_fmt;
+    w->vframe->width = ctx->width;
+    w->vframe->height = ctx->height;
+    if (av_frame_get_buffer(w->vframe, 0) < 0) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+static int mp4_add_audio(Mp4Writer *w, const MediaParams *params)
+{
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        fprintf(stderr, "No AAC encoder available\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    w->astream = avformat_new_stream(w->fmt_ctx, NULL);
+    w->acodec_ctx = avcodec_alloc_context3(codec);
+    w->aframe = av_frame_alloc();
+    if (!w->astream || !w->acodec_ctx || !w->aframe) {
+        fprintf(stderr, "Could not allocate audio encoder\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    AVCodecContext *ctx = w->acodec_ctx;
+    ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] :
+        AV_SAMPLE_FMT_FLTP;
+    ctx->sample_rate = SAMPLE_RATE;
+    ctx->channel_layout = AV_CH_LAYOUT_STEREO;
+    ctx->channels = CHANNELS;
+    ctx->bit_rate = 128000;
+    ctx->time_base = (AVRational){ 1, SAMPLE_RATE };
+    if (w->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (avcodec_open2(ctx, codec, NULL) < 0 ||
+        avcodec_parameters_from_context(w->astream->codecpar, ctx) < 0) {
+        fprintf(stderr, "Could not open audio encoder %s\n", codec->name);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    w->astream->time_base = ctx->time_base;
+    w->frame_size = ctx->frame_size > 0 ? ctx->frame_size : 1024;
+    w->audio_total = (int64_t)SAMPLE_RATE * params->seconds;
+
+    w->aframe->format = ctx->sample_fmt;
+    w->aframe->channel_layout = ctx->channel_layout;
+    w->aframe->sample_rate = SAMPLE_RATE;
+    w->aframe->nb_samples = w->frame_size;
+    w->pcm = malloc((size_t)w->frame_size * CHANNELS * 2);
+    if (!w->pcm || av_frame_get_buffer(w->aframe, 0) < 0) {
+        fprintf(stderr, "Could not allocate audio frame\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Same rate and layout: this only converts the sample format */
+    w->swr_ctx = swr_alloc_set_opts(NULL,
+        AV_CH_LAYOUT_STEREO, ctx->sample_fmt, SAMPLE_RATE,
+        AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, SAMPLE_RATE, 0, NULL);
+    if (!w->swr_ctx || swr_init(w->swr_ctx) < 0) {
+        fprintf(stderr, "Could not init resampler\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Encode audio up to sample frame 'until' */
+static int mp4_write_audio(Mp4Writer *w, int64_t until)
+{
+    if (until > w->audio_total) {
+        until = w->audio_total;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (w->audio_next < until) {
+        int count = w->audio_total - w->audio_next < w->frame_size ?
+            (int)(w->audio_total - w->audio_next) : w->frame_size;
+        const uint8_t *in[] = { (const uint8_t *)w->pcm };
+
+        if (av_frame_make_writable(w->aframe) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+
+        draw_audio(w->pcm, w->audio_next, count);
+        if (swr_convert(w->swr_ctx, w->aframe->data, count, in, count) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+
+        w->aframe->nb_samples = count;
+        w->aframe->pts = w->audio_next;
+        if (mp4_encode(w, w->acodec_ctx, w->astream, w->aframe) < 0) {
+            return -1;
+        }
+        else {
+            w->audio_next += count;
+        }
+    }
+
+    return 0;
+}
+
+/* The same test signal as the raw files, with or without video */
+static int write_mp4(const char *path, const MediaParams *params,
+    int with_video)
+{
+    Mp4Writer w;
+    long frames = (long)params->fps * params->seconds;
+    int header_written = 0;
+    int ret = -1;
+
+    memset(&w, 0, sizeof(w));
+
+    if (avformat_alloc_output_context2(&w.fmt_ctx, NULL, NULL, path) < 0) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    w.packet = av_packet_alloc();
+    if (!w.packet ||
+        (with_video && mp4_add_video(&w, params) < 0) ||
+        mp4_add_audio(&w, params) < 0) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (!(w.fmt_ctx->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&w.fmt_ctx->pb, path, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (avformat_write_header(w.fmt_ctx, NULL) < 0) {
+        fprintf(stderr, "Could not write header to %s\n", path);
+        goto cleanup;
+    }
+    else {
+        header_written = 1;
+    }
+
+    /* Keep the two streams roughly interleaved as they are generated */
+    for (long i = 0; with_video && i < frames; i++) {
+        if (av_frame_make_writable(w.vframe) < 0) {
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        draw_frame(params, i, w.vframe->data, w.vframe->linesize);
+        w.vframe->pts = i;
+        if (mp4_encode(&w, w.vcodec_ctx, w.vstream, w.vframe) < 0 ||
+            mp4_write_audio(&w,
+                (int64_t)(i + 1) * SAMPLE_RATE / params->fps) < 0) {
+            fprintf(stderr, "Could not encode %s\n", path);
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (mp4_write_audio(&w, w.audio_total) < 0 ||
+        (with_video && mp4_encode(&w, w.vcodec_ctx, w.vstream, NULL) < 0) ||
+        mp4_encode(&w, w.acodec_ctx, w.astream, NULL) < 0) {
+        fprintf(stderr, "Could not encode %s\n", path);
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (av_write_trailer(w.fmt_ctx) < 0) {
+        fprintf(stderr, "Could not finish %s\n", path);
+        goto cleanup;
+    }
+    else {
+        header_written = 0;
+    }
+
+    if (with_video) {
+        printf("%s: %s %dx%d, %d fps, %ld frames + %s audio\n", path,
+            w.vcodec_ctx->codec->name, params->width, params->height,
+            params->fps, frames, w.acodec_ctx->codec->name);
+    }
+    else {
+        printf("%s: %s audio, %d s\n", path, w.acodec_ctx->codec->name,
+            params->seconds);
+    }
+
+    ret = 0;
+
+cleanup:
+    if (header_written) {
+        av_write_trailer(w.fmt_ctx);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (w.fmt_ctx && w.fmt_ctx->pb &&
+        !(w.fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&w.fmt_ctx->pb);
+    }
+    else {
+        /* nothing */
+    }
+
+    swr_free(&w.swr_ctx);
+    free(w.pcm);
+    av_frame_free(&w.vframe);
+    av_frame_free(&w.aframe);
+    av_packet_free(&w.packet);
+    avcodec_free_context(&w.vcodec_ctx);
+    avcodec_free_context(&w.acodec_ctx);
+
+    if (w.fmt_ctx) {
+        avformat_free_context(w.fmt_ctx);
+    }
+    else {
+        /* nothing */
+    }
+
+    return ret;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-s WIDTHxHEIGHT] [-r FPS] [-t SECONDS] "
+        "[-p moving|static]\n"
+        "Writes %s, %s, %s and %s to the current directory.\n"
+        "Defaults: -s 640x480 -r 30 -t 10 -p moving\n",
+        argv0, VIDEO_YUV, AUDIO_PCM, VIDEO_MP4, AUDIO_MP4);
+}
+
+int main(int argc, char **argv)
+{
+    /* Defaults match what the raw players are built for */
+    MediaParams params = { 640, 480, 30, 10, 1 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:t:p:")) != -1) {
+        if (opt == 's' &&
+            sscanf(optarg, "%dx%d", &params.width, &params.height) == 2) {
+            /* nothing */
+        }
+        else if (opt == 'r') {
+            params.fps = atoi(optarg);
+        }
+        else if (opt == 't') {
+            params.seconds = atoi(optarg);
+        }
+        else if (opt == 'p' && strcmp(optarg, "moving") == 0) {
+            params.moving = 1;
+        }
+        else if (opt == 'p' && strcmp(optarg, "static") == 0) {
+            params.moving = 0;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* I420 needs even dimensions */
+    if (params.width <= 0 || params.height <= 0 || params.width % 2 ||
+        params.height % 2 || params.fps <= 0 || params.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (write_yuv(&params) < 0 || write_pcm(&params) < 0 ||
+        write_mp4(VIDEO_MP4, &params, 1) < 0 ||
+        write_mp4(AUDIO_MP4, &params, 0) < 0) {
+        return 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
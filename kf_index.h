@@ -0,0 +1,422 @@
+#ifndef KF_INDEX_H
+#define KF_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+/* Sidecar next to the media: "<media>.kfidx" */
+#define KF_INDEX_SUFFIX   ".kfidx"
+#define KF_INDEX_VERSION  2
+
+/*
+ * Keyframes of one stream, found by a single pass over the packets with
+ * no decoding and kept in a sidecar file. The demuxer's own seek table
+ * (MP4's sync sample table) already finds a keyframe by timestamp; what
+ * the index adds is each keyframe's dts next to its pts, so a seek lands
+ * on the last keyframe presented before the target even when B-frame
+ * reordering puts the target between that keyframe's dts and pts, and a
+ * container without a seek table does not have to bisect the file.
+ *
+ * The scan reads the whole file, so it never holds up playback: without
+ * a fresh sidecar it runs on a thread of its own and seeks use the
+ * demuxer alone until it is done. Where the sidecar cannot be written
+ * (read-only or remote media) the scan is not started at all, since it
+ * would only be repeated on every launch. The sidecar is text:
+ *   KFIDX <version> <media size> <media mtime> <stream> <tb num> <tb den>
+ *         <count>
+ *   <pts> <dts> <gop packets>     (one line per keyframe)
+ * and is rebuilt whenever the media's size or mtime no longer match.
+ */
+typedef struct {
+    int64_t pts;
+    int64_t dts;
+    int gop;
+} KfEntry;
+
+typedef struct {
+    KfEntry *entries;
+    int count;
+    int cap;
+    int stream;
+    AVRational time_base;
+    int max_gop;
+    char path[4096];
+    char sidecar[4096];
+    struct stat media;
+    SDL_Thread *builder;
+    SDL_atomic_t ready;
+    SDL_atomic_t abort;
+} KfIndex;
+
+static int kf_index_add(KfIndex *idx, const KfEntry *entry)
+{
+    if (idx->count == idx->cap) {
+        int cap = idx->cap > 0 ? idx->cap * 2 : 256;
+        KfEntry *grown = realloc(idx->entries, cap * sizeof(KfEntry));
+        if (!grown) {
+            return -1;
+        }
+        else {
+            idx->entries = grown;
+            idx->cap = cap;
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    idx->entries[idx->count++] = *entry;
+    if (entry->gop > idx->max_gop) {
+        idx->max_gop = entry->gop;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Stop and wait for a background build, then drop the entries */
+static void kf_index_free(KfIndex *idx)
+{
+    if (idx->builder) {
+        SDL_AtomicSet(&idx->abort, 1);
+        SDL_WaitThread(idx->builder, NULL);
+        idx->builder = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->count = 0;
+    idx->cap = 0;
+    idx->max_gop = 0;
+}
+
+/* Scan every packet of 'stream' in 'path' on a demuxer of its own */
+static int kf_index_build(KfIndex *idx, const char *path, int stream)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVPacket *packet = av_packet_alloc();
+    KfEntry *open_gop = NULL;
+    int ret = -1;
+
+    if (!packet) {
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (avformat_open_input(&fmt_ctx, path, NULL, NULL) < 0 ||
+        stream >= (int)fmt_ctx->nb_streams) {
+        fprintf(stderr, "Could not index %s\n", path);
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Packets of the other streams are not even read */
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        fmt_ctx->streams[i]->discard = i == stream ?
+            AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    idx->stream = stream;
+    idx->time_base = fmt_ctx->streams[stream]->time_base;
+
+    while (!SDL_AtomicGet(&idx->abort) &&
+           av_read_frame(fmt_ctx, packet) >= 0) {
+        if (packet->stream_index != stream) {
+            /* discarded stream */
+        }
+        else if (packet->flags & AV_PKT_FLAG_KEY) {
+            KfEntry entry;
+
+            entry.dts = packet->dts != AV_NOPTS_VALUE ?
+                packet->dts : packet->pts;
+            entry.pts = packet->pts != AV_NOPTS_VALUE ?
+                packet->pts : entry.dts;
+            entry.gop = 1;
+
+            if (kf_index_add(idx, &entry) < 0) {
+                av_packet_unref(packet);
+                goto cleanup;
+            }
+            else {
+                open_gop = &idx->entries[idx->count - 1];
+            }
+        }
+        else if (open_gop) {
+            open_gop->gop++;
+            if (open_gop->gop > idx->max_gop) {
+                idx->max_gop = open_gop->gop;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else {
+            /* leading packets before the first keyframe */
+        }
+
+        av_packet_unref(packet);
+    }
+
+    ret = idx->count > 0 && !SDL_AtomicGet(&idx->abort) ? 0 : -1;
+
+cleanup:
+    av_packet_free(&packet);
+
+    if (fmt_ctx) {
+        avformat_close_input(&fmt_ctx);
+    }
+    else {
+        /* nothing */
+    }
+
+    return ret;
+}
+
+static int kf_index_load(KfIndex *idx, const char *sidecar,
+    const struct stat *media, int stream)
+{
+    FILE *fp = fopen(sidecar, "r");
+    int version;
+    long long size;
+    long long mtime;
+    int file_stream;
+    int count;
+    int ret = -1;
+
+    if (!fp) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (fscanf(fp, "KFIDX %d %lld %lld %d %d %d %d", &version, &size,
+            &mtime, &file_stream, &idx->time_base.num, &idx->time_base.den,
+            &count) != 7 ||
+        version != KF_INDEX_VERSION || size != (long long)media->st_size ||
+        mtime != (long long)media->st_mtime || file_stream != stream ||
+        idx->time_base.num <= 0 || idx->time_base.den <= 0 || count <= 0) {
+        /* stale or foreign: rebuild */
+        goto cleanup;
+    }
+    else {
+        idx->stream = stream;
+    }
+
+    for (int i = 0; i < count; i++) {
+        KfEntry entry;
+
+        if (fscanf(fp, "%" SCNd64 " %" SCNd64 " %d", &entry.pts,
+                &entry.dts, &entry.gop) != 3 ||
+            kf_index_add(idx, &entry) < 0) {
+            kf_index_free(idx);
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    fclose(fp);
+
+    return ret;
+}
+
+/* Write via a temporary, so a reader never sees half an index */
+static void kf_index_save(KfIndex *idx, const char *sidecar,
+    const struct stat *media)
+{
+    char tmp[4096];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sidecar);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write %s\n", tmp);
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    fprintf(fp, "KFIDX %d %lld %lld %d %d %d %d\n", KF_INDEX_VERSION,
+        (long long)media->st_size, (long long)media->st_mtime, idx->stream,
+        idx->time_base.num, idx->time_base.den, idx->count);
+    for (int i = 0; i < idx->count; i++) {
+        fprintf(fp, "%" PRId64 " %" PRId64 " %d\n", idx->entries[i].pts,
+            idx->entries[i].dts, idx->entries[i].gop);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, sidecar) != 0) {
+        fprintf(stderr, "Could not write %s\n", sidecar);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Whether the sidecar can be written, without touching an existing one */
+static int kf_index_writable(const char *sidecar)
+{
+    char tmp[4096];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sidecar);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        return 0;
+    }
+    else {
+        fclose(fp);
+        remove(tmp);
+    }
+
+    return 1;
+}
+
+/* Builder thread: scan the media, save the sidecar, publish the index */
+static int kf_index_thread(void *arg)
+{
+    KfIndex *idx = arg;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    if (kf_index_build(idx, idx->path, idx->stream) < 0) {
+        SDL_AtomicSet(&idx->ready, -1);
+        return 0;
+    }
+    else {
+        kf_index_save(idx, idx->sidecar, &idx->media);
+    }
+
+    printf("Keyframe index built: %d keyframes, GOP up to %d, %.1f ms\n",
+        idx->count, idx->max_gop,
+        (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+            SDL_GetPerformanceFrequency());
+    SDL_AtomicSet(&idx->ready, 1);
+
+    return 0;
+}
+
+/* Load the sidecar for 'path', or start building it in the background if
+ * it is missing or stale; -1 leaves the player seeking without an index */
+static int kf_index_open(KfIndex *idx, const char *path, int stream)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    SDL_memset(idx, 0, sizeof(*idx));
+    snprintf(idx->path, sizeof(idx->path), "%s", path);
+    snprintf(idx->sidecar, sizeof(idx->sidecar), "%s%s", path,
+        KF_INDEX_SUFFIX);
+    idx->stream = stream;
+
+    if (stat(path, &idx->media) < 0) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (kf_index_load(idx, idx->sidecar, &idx->media, stream) == 0) {
+        SDL_AtomicSet(&idx->ready, 1);
+        printf("Keyframe index loaded: %d keyframes, GOP up to %d, "
+            "%.1f ms\n", idx->count, idx->max_gop,
+            (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+                SDL_GetPerformanceFrequency());
+        return 0;
+    }
+    else {
+        /* A half-read sidecar may have left entries behind */
+        kf_index_free(idx);
+    }
+
+    if (!kf_index_writable(idx->sidecar)) {
+        fprintf(stderr, "Could not write %s, not indexing\n", idx->sidecar);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    idx->builder = SDL_CreateThread(kf_index_thread, "kf_index", idx);
+    if (!idx->builder) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        printf("Keyframe index: building in the background\n");
+    }
+
+    return 0;
+}
+
+/* Last keyframe presented at or before 'pts', or the first one */
+static const KfEntry *kf_index_find(const KfIndex *idx, int64_t pts)
+{
+    int lo = 0;
+    int hi = idx->count - 1;
+
+    if (idx->count == 0) {
+        return NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (idx->entries[mid].pts <= pts) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+
+    return &idx->entries[lo];
+}
+
+/*
+ * Reposition 'fmt_ctx' so the next packet of the indexed stream is the
+ * keyframe before 'seconds' (stream time, as pts * time base). Returns
+ * the target in stream time base: frames before it only need decoding,
+ * not showing. Until the index is ready, or without one, it falls back
+ * to a plain backward seek.
+ */
+static int64_t kf_index_seek(KfIndex *idx, AVFormatContext *fmt_ctx,
+    int stream, double seconds)
+{
+    AVRational tb = fmt_ctx->streams[stream]->time_base;
+    int64_t target = (int64_t)((seconds > 0.0 ? seconds : 0.0) * tb.den /
+        tb.num);
+    const KfEntry *key = SDL_AtomicGet(&idx->ready) > 0 ?
+        kf_index_find(idx, target) : NULL;
+
+    if (av_seek_frame(fmt_ctx, stream, key ? key->dts : target,
+            AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "Could not seek to %.3f s\n", seconds);
+    }
+    else {
+        /* nothing */
+    }
+
+    return target;
+}
+
+#endif
@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <SDL2/SDL.h>
+#include "audio_latency.h"
+#include "audio_ring.h"
+#include "frame_source.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "yuv_rgb.h"
 
 #define VIDEO_FILE   "video.yuv"
 #define AUDIO_FILE   "audio.pcm"
@@ -9,63 +15,98 @@
 #define FPS          30
 #define SAMPLE_RATE  44100
 #define CHANNELS     2
+#define VIDEO_SLOTS  3
+#define SEEK_SHORT   5.0
+#define SEEK_LONG    60.0
+#define WAIT_MAX_MS  100
 
+/* One frame of the ring: where its planes are and when it is due */
 typedef struct {
-    FILE *fp;
+    long index;
+    double pts;
+    const unsigned char *y_plane;
+    const unsigned char *u_plane;
+    const unsigned char *v_plane;
+} VideoSlot;
+
+typedef struct {
+    FrameSource src;
+    Prefetch prefetch;
+    SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
-    unsigned char *y_plane;
-    unsigned char *u_plane;
-    unsigned char *v_plane;
-    int y_size;
-    int uv_size;
-    int frame_num;
+    YuvRgb rgb;
+    VideoSlot slots[VIDEO_SLOTS];
+    int current;
+    long shown;
+    int repaint;
+    long next_frame;
+    int eof;
     int done;
+    Metrics *metrics;
 } VideoResource;
 
 typedef struct {
     FILE *fp;
     SDL_AudioDeviceID dev;
-    unsigned char *buffer;
-    int buffer_size;
+    AudioRing ring;
+    Prefetch prefetch;
+    double clock_base;
     int done;
+    Metrics *metrics;
 } AudioResource;
 
 /* Video functions */
 
-VideoResource *video_open(SDL_Renderer *renderer)
+void video_close(VideoResource *res)
 {
-    VideoResource *res = calloc(1, sizeof(VideoResource));
     if (!res) {
-        return NULL;
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (res->texture) {
+        SDL_DestroyTexture(res->texture);
     }
     else {
         /* nothing */
     }
 
-    res->renderer = renderer;
-    res->y_size = WIDTH * HEIGHT;
-    res->uv_size = (WIDTH / 2) * (HEIGHT / 2);
+    if (res->renderer) {
+        SDL_DestroyRenderer(res->renderer);
+    }
+    else {
+        /* nothing */
+    }
 
-    res->fp = fopen(VIDEO_FILE, "rb");
-    if (!res->fp) {
-        fprintf(stderr, "Could not open %s\n", VIDEO_FILE);
-        free(res);
+    prefetch_stop(&res->prefetch);
+    frame_source_close(&res->src);
+    free(res);
+}
+
+VideoResource *video_open(SDL_Window *window, const char *path,
+    Metrics *metrics)
+{
+    VideoResource *res = calloc(1, sizeof(VideoResource));
+    if (!res) {
         return NULL;
     }
     else {
         /* nothing */
     }
 
-    res->y_plane = malloc(res->y_size);
-    res->u_plane = malloc(res->uv_size);
-    res->v_plane = malloc(res->uv_size);
-    if (!res->y_plane || !res->u_plane || !res->v_plane) {
-        fprintf(stderr, "Could not allocate video buffers\n");
-        fclose(res->fp);
-        free(res->y_plane);
-        free(res->u_plane);
-        free(res->v_plane);
+    res->window = window;
+    res->metrics = metrics;
+    res->current = -1;
+    res->shown = -1;
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        res->slots[i].index = -1;
+    }
+
+    /* A Y4M header overrides the built-in geometry and rate */
+    if (frame_source_open(&res->src, path, WIDTH, HEIGHT, FPS) < 0) {
         free(res);
         return NULL;
     }
@@ -73,15 +114,38 @@ VideoResource *video_open(SDL_Renderer *renderer)
         /* nothing */
     }
 
-    res->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
-        SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
-    if (!res->texture) {
-        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
-        fclose(res->fp);
-        free(res->y_plane);
-        free(res->u_plane);
-        free(res->v_plane);
-        free(res);
+    SDL_SetWindowSize(window, res->src.width, res->src.height);
+
+    /* YUV_RGB converts into the window surface, which rules out a
+     * renderer on the same window */
+    if (yuv_rgb_init(&res->rgb, window, res->src.height)) {
+        /* nothing */
+    }
+    else {
+        res->renderer = SDL_CreateRenderer(window, -1,
+            SDL_RENDERER_ACCELERATED);
+        if (res->renderer) {
+            res->texture = SDL_CreateTexture(res->renderer,
+                SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING,
+                res->src.width, res->src.height);
+        }
+        else {
+            /* nothing */
+        }
+
+        if (!res->texture) {
+            fprintf(stderr, "Could not create renderer: %s\n",
+                SDL_GetError());
+            video_close(res);
+            return NULL;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (prefetch_start(&res->prefetch, &res->src, NULL, NULL) < 0) {
+        video_close(res);
         return NULL;
     }
     else {
@@ -91,86 +155,188 @@ VideoResource *video_open(SDL_Renderer *renderer)
     return res;
 }
 
-void video_close(VideoResource *res)
+/* A slot that is neither due for presentation nor ahead of the playhead */
+static int video_free_slot(VideoResource *res, long expected_frame)
 {
-    if (!res) {
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        if (i != res->current &&
+            (res->slots[i].index < 0 ||
+             res->slots[i].index < expected_frame)) {
+            return i;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return -1;
+}
+
+void video_sync(VideoResource *res, double dt)
+{
+    if (!res || res->done) {
         return;
     }
     else {
         /* nothing */
     }
 
-    if (res->texture) {
-        SDL_DestroyTexture(res->texture);
+    /* Calculate expected frame based on elapsed time */
+    double fps = frame_source_fps(&res->src);
+    long expected_frame = (long)(dt * fps);
+
+    /* Fell behind: frames sit at known offsets, so jump straight to the
+     * playhead instead of fetching the ones nobody will see */
+    if (res->next_frame < expected_frame) {
+        res->next_frame = expected_frame;
     }
     else {
         /* nothing */
     }
 
-    if (res->fp) {
-        fclose(res->fp);
+    /* Fill free slots up to the playhead, then read ahead of it */
+    while (!res->eof &&
+           res->next_frame <= expected_frame + VIDEO_SLOTS - 2) {
+        int free_slot = video_free_slot(res, expected_frame);
+        if (free_slot < 0) {
+            break;
+        }
+        else {
+            /* nothing */
+        }
+
+        VideoSlot *slot = &res->slots[free_slot];
+        Uint64 t = metrics_begin();
+        if (prefetch_get(&res->prefetch, res->next_frame, &slot->y_plane,
+                &slot->u_plane, &slot->v_plane) < 0) {
+            res->eof = 1;
+        }
+        else {
+            slot->index = res->next_frame;
+            slot->pts = (double)res->next_frame / fps;
+            res->next_frame++;
+        }
+        metrics_end(res->metrics, METRICS_READ, t);
+    }
+
+    /* Present the newest frame whose time has come */
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        long index = res->slots[i].index;
+        if (index >= 0 && index <= expected_frame &&
+            (res->current < 0 || index > res->slots[res->current].index)) {
+            res->current = i;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    /* Done once the playhead is past the last frame in the file */
+    if (res->eof && expected_frame >= res->next_frame) {
+        res->done = 1;
     }
     else {
         /* nothing */
     }
+}
 
-    free(res->y_plane);
-    free(res->u_plane);
-    free(res->v_plane);
-    free(res);
+/* Show frame 'index' next: drop the slots and read ahead from there */
+void video_seek(VideoResource *res, long index)
+{
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        res->slots[i].index = -1;
+    }
+
+    res->current = -1;
+    res->shown = -1;
+    res->next_frame = index;
+    res->eof = 0;
+    res->done = 0;
+
+    prefetch_seek(&res->prefetch, index, 0);
 }
 
-void video_sync(VideoResource *res, double dt)
+/* Seconds until the frame after the one on screen is due; the longest
+ * wait once there are no more frames */
+double video_next_due(VideoResource *res, double dt)
 {
     if (!res || res->done) {
-        return;
+        return WAIT_MAX_MS / 1000.0;
+    }
+    else if (res->current < 0) {
+        return 0.0;
     }
     else {
-        /* nothing */
+        return (res->slots[res->current].index + 1) /
+            frame_source_fps(&res->src) - dt;
     }
+}
 
-    /* Calculate expected frame based on elapsed time */
-    int expected_frame = (int)(dt * FPS);
-
-    /* Read frames to catch up */
-    while (res->frame_num <= expected_frame && !res->done) {
-        if (fread(res->y_plane, 1, res->y_size, res->fp) !=
-                (size_t)res->y_size ||
-            fread(res->u_plane, 1, res->uv_size, res->fp) !=
-                (size_t)res->uv_size ||
-            fread(res->v_plane, 1, res->uv_size, res->fp) !=
-                (size_t)res->uv_size) {
-            res->done = 1;
-            break;
-        }
-        else {
-            res->frame_num++;
-        }
+/* Presented frame time minus the master clock (positive = video ahead) */
+double video_offset(VideoResource *res, double dt)
+{
+    if (!res || res->current < 0) {
+        return 0.0;
+    }
+    else {
+        return res->slots[res->current].pts - dt;
     }
 }
 
+/* Upload and present the current frame, if it is not on screen yet */
 void video_present(VideoResource *res)
 {
-    if (!res || res->done) {
+    if (!res || res->done || res->current < 0) {
         return;
     }
     else {
         /* nothing */
     }
 
-    SDL_UpdateYUVTexture(res->texture, NULL,
-        res->y_plane, WIDTH,
-        res->u_plane, WIDTH / 2,
-        res->v_plane, WIDTH / 2);
+    VideoSlot *slot = &res->slots[res->current];
+    if (slot->index == res->shown && !res->repaint) {
+        return;
+    }
+    else {
+        res->repaint = 0;
+    }
+
+    Uint64 t = metrics_begin();
+    if (res->rgb.window) {
+        yuv_rgb_convert(&res->rgb, slot->y_plane, res->src.width,
+            slot->u_plane, res->src.chroma_width,
+            slot->v_plane, res->src.chroma_width,
+            res->src.width, res->src.height);
+        t = metrics_end(res->metrics, METRICS_UPLOAD, t);
 
-    SDL_RenderClear(res->renderer);
-    SDL_RenderCopy(res->renderer, res->texture, NULL, NULL);
-    SDL_RenderPresent(res->renderer);
+        SDL_UpdateWindowSurface(res->window);
+        metrics_end(res->metrics, METRICS_PRESENT, t);
+    }
+    else {
+        SDL_UpdateYUVTexture(res->texture, NULL,
+            slot->y_plane, res->src.width,
+            slot->u_plane, res->src.chroma_width,
+            slot->v_plane, res->src.chroma_width);
+        t = metrics_end(res->metrics, METRICS_UPLOAD, t);
+
+        SDL_RenderClear(res->renderer);
+        SDL_RenderCopy(res->renderer, res->texture, NULL, NULL);
+        SDL_RenderPresent(res->renderer);
+        metrics_end(res->metrics, METRICS_PRESENT, t);
+    }
+
+    if (slot->index != res->shown) {
+        res->shown = slot->index;
+        metrics_frame(res->metrics);
+    }
+    else {
+        /* nothing */
+    }
 }
 
 /* Audio functions */
 
-AudioResource *audio_open(void)
+AudioResource *audio_open(Metrics *metrics)
 {
     AudioResource *res = calloc(1, sizeof(AudioResource));
     if (!res) {
@@ -180,7 +346,7 @@ AudioResource *audio_open(void)
         /* nothing */
     }
 
-    res->buffer_size = (SAMPLE_RATE * CHANNELS * 2) / FPS;
+    res->metrics = metrics;
 
     res->fp = fopen(AUDIO_FILE, "rb");
     if (!res->fp) {
@@ -192,9 +358,15 @@ AudioResource *audio_open(void)
         /* nothing */
     }
 
-    res->buffer = malloc(res->buffer_size);
-    if (!res->buffer) {
+    /* PREFETCH_AUDIO_MS of audio, or what AUDIO_LATENCY_MS leaves after
+     * the device buffer, kept topped up by the prefetch thread */
+    Uint16 samples = audio_latency_samples(SAMPLE_RATE);
+    int ring_size = audio_latency_ring(SAMPLE_RATE, CHANNELS * 2, samples,
+        prefetch_audio_bytes(SAMPLE_RATE * CHANNELS * 2));
+    if (audio_ring_init(&res->ring, ring_size, ring_size / 2,
+            CHANNELS * 2) < 0) {
         fprintf(stderr, "Could not allocate audio buffer\n");
+        audio_ring_destroy(&res->ring);
         fclose(res->fp);
         free(res);
         return NULL;
@@ -204,17 +376,31 @@ AudioResource *audio_open(void)
     }
 
     SDL_AudioSpec spec;
+    SDL_AudioSpec have;
     spec.freq = SAMPLE_RATE;
     spec.format = AUDIO_S16LSB;
     spec.channels = CHANNELS;
-    spec.samples = 1024;
-    spec.callback = NULL;
+    spec.samples = samples;
+    spec.callback = audio_ring_callback;
+    spec.userdata = &res->ring;
+
+    if (prefetch_start(&res->prefetch, NULL, res->fp, &res->ring) < 0) {
+        prefetch_stop(&res->prefetch);
+        fclose(res->fp);
+        audio_ring_destroy(&res->ring);
+        free(res);
+        return NULL;
+    }
+    else {
+        /* nothing */
+    }
 
-    res->dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    res->dev = SDL_OpenAudioDevice(NULL, 0, &spec, &have, 0);
     if (!res->dev) {
         fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
+        prefetch_stop(&res->prefetch);
         fclose(res->fp);
-        free(res->buffer);
+        audio_ring_destroy(&res->ring);
         free(res);
         return NULL;
     }
@@ -222,6 +408,8 @@ AudioResource *audio_open(void)
         /* nothing */
     }
 
+    res->ring.silence = have.silence;
+
     SDL_PauseAudioDevice(res->dev, 0);
 
     return res;
@@ -236,12 +424,18 @@ void audio_close(AudioResource *res)
         /* nothing */
     }
 
+    /* The reader goes first, it fills the ring from the file */
+    prefetch_stop(&res->prefetch);
+
     /* Wait for audio to finish */
     if (res->dev) {
-        while (SDL_GetQueuedAudioSize(res->dev) > 0) {
+        audio_ring_finish(&res->ring);
+        while (audio_ring_fill(&res->ring) >= CHANNELS * 2) {
             SDL_Delay(10);
         }
         SDL_CloseAudioDevice(res->dev);
+        metrics_audio(res->metrics, (Uint64)(audio_ring_played(&res->ring,
+            SAMPLE_RATE * CHANNELS * 2) / (CHANNELS * 2)));
     }
     else {
         /* nothing */
@@ -254,7 +448,7 @@ void audio_close(AudioResource *res)
         /* nothing */
     }
 
-    free(res->buffer);
+    audio_ring_destroy(&res->ring);
     free(res);
 }
 
@@ -267,21 +461,42 @@ void audio_sync(AudioResource *res, double dt)
         /* nothing */
     }
 
-    int queued = SDL_GetQueuedAudioSize(res->dev);
     (void)dt;
 
-    /* Keep buffer filled ahead of playback */
-    while (!res->done && queued < res->buffer_size * 4) {
-        size_t bytes_read = fread(res->buffer, 1, res->buffer_size, res->fp);
-        if (bytes_read == 0) {
-            res->done = 1;
-            break;
-        }
-        else {
-            SDL_QueueAudio(res->dev, res->buffer, bytes_read);
-            queued += bytes_read;
-        }
-    }
+    /* The prefetch thread reads the file into the ring */
+    res->done = SDL_AtomicGet(&res->ring.finished);
+}
+
+/* Play on from 'seconds' into the file, the byte offset following from
+ * the sample rate */
+void audio_seek(AudioResource *res, double seconds)
+{
+    Sint64 sample = (Sint64)(seconds * SAMPLE_RATE);
+
+    /* What was heard so far, the ring counts from zero again */
+    metrics_audio(res->metrics, (Uint64)(audio_ring_played(&res->ring,
+        SAMPLE_RATE * CHANNELS * 2) / (CHANNELS * 2)));
+
+    SDL_LockAudioDevice(res->dev);
+    prefetch_seek(&res->prefetch, 0, sample * CHANNELS * 2);
+    SDL_UnlockAudioDevice(res->dev);
+
+    res->clock_base = (double)sample / SAMPLE_RATE;
+    res->done = 0;
+}
+
+/* Audio still playing (or about to), so it can drive the timeline */
+int audio_playing(AudioResource *res)
+{
+    return res &&
+        (!res->done || audio_ring_fill(&res->ring) >= CHANNELS * 2);
+}
+
+/* Seconds of audio heard, as counted by the device callback */
+double audio_clock(AudioResource *res)
+{
+    return res->clock_base + audio_ring_played(&res->ring,
+        SAMPLE_RATE * CHANNELS * 2) / (SAMPLE_RATE * CHANNELS * 2);
 }
 
 void audio_present(AudioResource *res)
@@ -290,16 +505,32 @@ void audio_present(AudioResource *res)
     (void)res;
 }
 
+/* Seek both streams to 'seconds', audio to the first sample of the
+ * frame shown there; returns that frame */
+long av_seek(VideoResource *video, AudioResource *audio, double seconds)
+{
+    double fps = frame_source_fps(&video->src);
+    long index = seconds > 0.0 ? (long)(seconds * fps) : 0;
+
+    video_seek(video, index);
+    audio_seek(audio, index / fps);
+
+    return index;
+}
+
 /* Main */
 
-int main(void)
+int main(int argc, char **argv)
 {
     SDL_Window *window = NULL;
-    SDL_Renderer *renderer = NULL;
     VideoResource *video = NULL;
     AudioResource *audio = NULL;
+    Metrics metrics;
+    const char *path = argc > 1 ? argv[1] : VIDEO_FILE;
     int ret = 1;
 
+    metrics_init(&metrics, "main");
+
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
         return 1;
@@ -319,16 +550,8 @@ int main(void)
         /* nothing */
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (!renderer) {
-        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
-        goto cleanup;
-    }
-    else {
-        /* nothing */
-    }
-
-    video = video_open(renderer);
+    /* Sizes the window to the video and sets up how frames reach it */
+    video = video_open(window, path, &metrics);
     if (!video) {
         goto cleanup;
     }
@@ -336,7 +559,7 @@ int main(void)
         /* nothing */
     }
 
-    audio = audio_open();
+    audio = audio_open(&metrics);
     if (!audio) {
         goto cleanup;
     }
@@ -346,11 +569,30 @@ int main(void)
 
     /* Main loop */
     SDL_Event event;
+    int have_event = 0;
     int quit = 0;
-    Uint32 start_time = SDL_GetTicks();
+    double clock_offset = -(SDL_GetTicks() / 1000.0);
+    double av_offset = 0.0;
+    double av_offset_max = 0.0;
+    long bench_frame = 0;
 
     while (!quit && (!video->done || !audio->done)) {
-        double dt = (SDL_GetTicks() - start_time) / 1000.0;
+        double now = SDL_GetTicks() / 1000.0;
+        double dt;
+
+        /* Audio is the master clock; wall time only takes over once it
+         * has run out, continuing from where audio left off */
+        if (metrics.bench && !video->done) {
+            /* Bench mode: one new frame per pass, audio runs free */
+            dt = (double)bench_frame++ / frame_source_fps(&video->src);
+        }
+        else if (audio_playing(audio)) {
+            dt = audio_clock(audio);
+            clock_offset = dt - now;
+        }
+        else {
+            dt = now + clock_offset;
+        }
 
         video_sync(video, dt);
         audio_sync(audio, dt);
@@ -358,9 +600,36 @@ int main(void)
         video_present(video);
         audio_present(audio);
 
-        SDL_Delay(1);
+        if (!video->done) {
+            av_offset = video_offset(video, dt);
+            if (SDL_fabs(av_offset) > SDL_fabs(av_offset_max)) {
+                av_offset_max = av_offset;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else {
+            /* nothing */
+        }
 
-        while (SDL_PollEvent(&event)) {
+        /* Sleep until the next frame is due or an event comes in; bench
+         * mode only looks for events while there are frames */
+        if (metrics.bench && !video->done) {
+            have_event = SDL_PollEvent(&event);
+        }
+        else {
+            double due = video_next_due(video, dt);
+            int wait = due > 0.0 ? (int)SDL_ceil(due * 1000.0) : 0;
+
+            have_event = SDL_WaitEventTimeout(&event,
+                wait < WAIT_MAX_MS ? wait : WAIT_MAX_MS);
+        }
+
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
+
+        while (have_event) {
             if (event.type == SDL_QUIT) {
                 quit = 1;
             }
@@ -368,20 +637,53 @@ int main(void)
                      event.key.keysym.sym == SDLK_ESCAPE) {
                 quit = 1;
             }
+            else if (event.type == SDL_KEYDOWN &&
+                     (event.key.keysym.sym == SDLK_LEFT ||
+                      event.key.keysym.sym == SDLK_RIGHT ||
+                      event.key.keysym.sym == SDLK_DOWN ||
+                      event.key.keysym.sym == SDLK_UP ||
+                      event.key.keysym.sym == SDLK_HOME)) {
+                SDL_Keycode sym = event.key.keysym.sym;
+                double target = sym == SDLK_LEFT ? dt - SEEK_SHORT :
+                    sym == SDLK_RIGHT ? dt + SEEK_SHORT :
+                    sym == SDLK_DOWN ? dt - SEEK_LONG :
+                    sym == SDLK_UP ? dt + SEEK_LONG : 0.0;
+
+                /* Left/Right 5 s, Down/Up 60 s, Home to the start */
+                bench_frame = av_seek(video, audio, target);
+                clock_offset = bench_frame / frame_source_fps(&video->src) -
+                    SDL_GetTicks() / 1000.0;
+            }
+            else if (event.type == SDL_WINDOWEVENT &&
+                     (event.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                      event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+                /* The window lost what it showed */
+                video->repaint = 1;
+            }
             else {
                 /* ignore */
             }
+
+            have_event = SDL_PollEvent(&event);
         }
     }
 
+    printf("A/V offset: last %.1f ms, max %.1f ms\n",
+        av_offset * 1000.0, av_offset_max * 1000.0);
+    SDL_LockAudioDevice(audio->dev);
+    audio_latency_report(&audio->ring, SAMPLE_RATE * CHANNELS * 2, &metrics);
+    SDL_UnlockAudioDevice(audio->dev);
+    prefetch_report(&video->prefetch);
+    prefetch_report(&audio->prefetch);
+
     ret = 0;
 
 cleanup:
     video_close(video);
     audio_close(audio);
 
-    if (renderer) {
-        SDL_DestroyRenderer(renderer);
+    if (ret == 0) {
+        metrics_report(&metrics);
     }
     else {
         /* nothing */
@@ -0,0 +1,430 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <SDL2/SDL.h>
+
+/* Latency buckets: exact below 4 us, then four per power of two (~8 s) */
+#define METRICS_BUCKETS  88
+
+/*
+ * Where each player spends its time, per stage of the pipeline. Every
+ * timed call lands in a fixed-bucket latency histogram, so a stutter can
+ * be pinned on I/O, decode, upload or present after the fact.
+ *
+ *   BENCH=1         run as fast as possible instead of in real time and
+ *                   print one JSON line of results on exit (make bench)
+ *   METRICS_FILE    write the histograms there on exit and on SIGUSR1;
+ *                   CSV if the name ends in .csv, JSON otherwise
+ *
+ * A Metrics is written by one thread per stage, so the counters take no
+ * locks; a thread timing a stage another thread also times (audio decode
+ * next to video decode) keeps a Metrics of its own for metrics_merge.
+ * A SIGUSR1 snapshot may be a sample behind on the other threads.
+ */
+enum {
+    METRICS_READ,       /* file or demuxer I/O */
+    METRICS_DECODE,     /* one packet sent and its frames received */
+    METRICS_RESAMPLE,   /* audio sample format/rate conversion */
+    METRICS_QUEUE,      /* audio handed to the device queue */
+    METRICS_UPLOAD,     /* frame into the texture */
+    METRICS_PRESENT,    /* clear, copy and present */
+    METRICS_STAGES
+};
+
+static const char *metrics_stage_names[METRICS_STAGES] = {
+    "read", "decode", "resample", "queue", "upload", "present"
+};
+
+typedef struct {
+    Uint64 ticks;
+    Uint32 count;
+    Uint32 max_us;
+    Uint32 buckets[METRICS_BUCKETS];
+} MetricsStage;
+
+typedef struct {
+    const char *player;
+    const char *path;
+    int bench;
+    Uint64 start;
+    Uint64 freq;
+    Uint64 frames;
+    Uint64 audio_samples;
+    int latency_target_ms;
+    double latency_ms;
+    double latency_max_ms;
+    int underruns;
+    int has_latency;
+    const char *open_how;
+    double open_ms;
+    double first_ms;
+    int has_first;
+    MetricsStage stages[METRICS_STAGES];
+} Metrics;
+
+static volatile sig_atomic_t metrics_dump_requested;
+
+static void metrics_signal(int sig)
+{
+    (void)sig;
+    metrics_dump_requested = 1;
+}
+
+static void metrics_init(Metrics *m, const char *player)
+{
+    const char *env = getenv("BENCH");
+
+    SDL_memset(m, 0, sizeof(*m));
+    m->player = player;
+    m->path = getenv("METRICS_FILE");
+    m->bench = env && atoi(env) > 0;
+    m->start = SDL_GetPerformanceCounter();
+    m->freq = SDL_GetPerformanceFrequency();
+
+    if (m->path && m->path[0]) {
+        signal(SIGUSR1, metrics_signal);
+    }
+    else {
+        m->path = NULL;
+    }
+}
+
+static int metrics_bucket(Uint32 us)
+{
+    int msb = 2;
+
+    if (us < 4) {
+        return (int)us;
+    }
+    else {
+        /* nothing */
+    }
+
+    while ((us >> msb) > 1) {
+        msb++;
+    }
+
+    int bucket = (msb - 1) * 4 + (int)((us >> (msb - 2)) & 3);
+
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/* Smallest value (us) that lands in 'bucket' */
+static Uint32 metrics_bucket_floor(int bucket)
+{
+    if (bucket < 4) {
+        return (Uint32)bucket;
+    }
+    else {
+        return (Uint32)(4 + bucket % 4) << (bucket / 4 - 1);
+    }
+}
+
+/* Timestamp to start a stage from */
+static Uint64 metrics_begin(void)
+{
+    return SDL_GetPerformanceCounter();
+}
+
+/* Charge one sample of 'ticks' to 'stage' */
+static void metrics_add(Metrics *m, int stage, Uint64 ticks)
+{
+    MetricsStage *s = &m->stages[stage];
+    Uint64 us = ticks * 1000000 / m->freq;
+    Uint32 clamped = us > 0xFFFFFFFFu ? 0xFFFFFFFFu : (Uint32)us;
+
+    s->ticks += ticks;
+    s->count++;
+    s->buckets[metrics_bucket(clamped)]++;
+    if (clamped > s->max_us) {
+        s->max_us = clamped;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Charge the time since 'begin' to 'stage'; returns now, so stages chain */
+static Uint64 metrics_end(Metrics *m, int stage, Uint64 begin)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    metrics_add(m, stage, now - begin);
+
+    return now;
+}
+
+/* Add the time since 'begin' to '*total', for a sample made of several
+ * pieces (one packet's send and receives, without the queueing between
+ * them); returns now */
+static Uint64 metrics_lap(Uint64 *total, Uint64 begin)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    *total += now - begin;
+
+    return now;
+}
+
+/* Add the stage timings collected in 'from' (on other threads) to 'm' */
+static void metrics_merge(Metrics *m, const Metrics *from)
+{
+    for (int i = 0; i < METRICS_STAGES; i++) {
+        MetricsStage *s = &m->stages[i];
+        const MetricsStage *f = &from->stages[i];
+
+        s->ticks += f->ticks;
+        s->count += f->count;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            s->buckets[b] += f->buckets[b];
+        }
+
+        if (f->max_us > s->max_us) {
+            s->max_us = f->max_us;
+        }
+        else {
+            /* nothing */
+        }
+    }
+}
+
+/* The player's first output: time to first frame, from metrics_init */
+static void metrics_first(Metrics *m)
+{
+    if (!m->has_first) {
+        m->first_ms = (double)(SDL_GetPerformanceCounter() - m->start) *
+            1000.0 / m->freq;
+        m->has_first = 1;
+        printf("Time to first frame: %.1f ms\n", m->first_ms);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* A new frame reached the screen */
+static void metrics_frame(Metrics *m)
+{
+    metrics_first(m);
+    m->frames++;
+}
+
+/* How the media's stream info was found, and how long that took */
+static void metrics_open(Metrics *m, const char *how, double ms)
+{
+    m->open_how = how;
+    m->open_ms = ms;
+}
+
+/* Sample frames (all channels) handed to the audio device */
+static void metrics_audio(Metrics *m, Uint64 samples)
+{
+    m->audio_samples += samples;
+}
+
+/* Measured audio output latency (ms) against its target, 0 for none */
+static void metrics_latency(Metrics *m, int target_ms, double mean_ms,
+    double max_ms, int underruns)
+{
+    m->latency_target_ms = target_ms;
+    m->latency_ms = mean_ms;
+    m->latency_max_ms = max_ms;
+    m->underruns = underruns;
+    m->has_latency = 1;
+}
+
+/* Upper edge of the bucket holding the 'pct' percentile, capped at max */
+static Uint32 metrics_percentile(const MetricsStage *s, int pct)
+{
+    Uint64 rank = ((Uint64)s->count * pct + 99) / 100;
+    Uint64 seen = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS && rank > 0; i++) {
+        seen += s->buckets[i];
+        if (seen >= rank) {
+            Uint32 top = i + 1 < METRICS_BUCKETS ?
+                metrics_bucket_floor(i + 1) - 1 : s->max_us;
+            return top < s->max_us ? top : s->max_us;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return 0;
+}
+
+/* The whole report as one JSON object on one line */
+static void metrics_write_json(Metrics *m, FILE *fp, int with_buckets)
+{
+    double seconds = (double)(SDL_GetPerformanceCounter() - m->start) /
+        m->freq;
+
+    fprintf(fp, "{\"player\":\"%s\",\"seconds\":%.3f,\"frames\":%llu,"
+        "\"fps\":%.1f", m->player, seconds,
+        (unsigned long long)m->frames,
+        seconds > 0.0 ? m->frames / seconds : 0.0);
+
+    if (m->open_how) {
+        fprintf(fp, ",\"stream_info\":{\"how\":\"%s\",\"ms\":%.1f}",
+            m->open_how, m->open_ms);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (m->has_first) {
+        fprintf(fp, ",\"first_frame_ms\":%.1f", m->first_ms);
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int i = 0; i < METRICS_STAGES; i++) {
+        const MetricsStage *s = &m->stages[i];
+        double ms = (double)s->ticks / m->freq * 1000.0;
+
+        fprintf(fp, ",\"%s\":{\"count\":%u,\"total_ms\":%.3f,"
+            "\"per_frame_us\":%.1f,\"p50_us\":%u,\"p99_us\":%u,"
+            "\"max_us\":%u", metrics_stage_names[i], s->count, ms,
+            m->frames > 0 ? ms * 1000.0 / m->frames : 0.0,
+            metrics_percentile(s, 50), metrics_percentile(s, 99),
+            s->max_us);
+
+        /* Non-empty buckets as [lowest us, count] */
+        if (with_buckets) {
+            const char *sep = "";
+
+            fprintf(fp, ",\"buckets\":[");
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                if (s->buckets[b] > 0) {
+                    fprintf(fp, "%s[%u,%u]", sep, metrics_bucket_floor(b),
+                        s->buckets[b]);
+                    sep = ",";
+                }
+                else {
+                    /* nothing */
+                }
+            }
+            fprintf(fp, "]");
+        }
+        else {
+            /* nothing */
+        }
+
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, ",\"audio_samples\":%llu,\"samples_per_sec\":%.0f",
+        (unsigned long long)m->audio_samples,
+        seconds > 0.0 ? m->audio_samples / seconds : 0.0);
+
+    if (m->has_latency) {
+        fprintf(fp, ",\"audio_latency\":{\"target_ms\":%d,\"mean_ms\":%.1f,"
+            "\"max_ms\":%.1f,\"underruns\":%d}", m->latency_target_ms,
+            m->latency_ms, m->latency_max_ms, m->underruns);
+    }
+    else {
+        /* nothing */
+    }
+
+    fprintf(fp, "}\n");
+}
+
+/* One row per stage, then one per non-empty bucket */
+static void metrics_write_csv(Metrics *m, FILE *fp)
+{
+    fprintf(fp, "player,stage,count,total_ms,p50_us,p99_us,max_us\n");
+    for (int i = 0; i < METRICS_STAGES; i++) {
+        const MetricsStage *s = &m->stages[i];
+
+        fprintf(fp, "%s,%s,%u,%.3f,%u,%u,%u\n", m->player,
+            metrics_stage_names[i], s->count,
+            (double)s->ticks / m->freq * 1000.0,
+            metrics_percentile(s, 50), metrics_percentile(s, 99),
+            s->max_us);
+    }
+
+    fprintf(fp, "\nplayer,stage,bucket_us,count\n");
+    for (int i = 0; i < METRICS_STAGES; i++) {
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            if (m->stages[i].buckets[b] > 0) {
+                fprintf(fp, "%s,%s,%u,%u\n", m->player,
+                    metrics_stage_names[i], metrics_bucket_floor(b),
+                    m->stages[i].buckets[b]);
+            }
+            else {
+                /* nothing */
+            }
+        }
+    }
+}
+
+/* Write METRICS_FILE via a temporary, so readers never see half a file */
+static void metrics_dump(Metrics *m)
+{
+    char tmp[4096];
+    size_t len = strlen(m->path);
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write %s\n", tmp);
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (len >= 4 && strcmp(m->path + len - 4, ".csv") == 0) {
+        metrics_write_csv(m, fp);
+    }
+    else {
+        metrics_write_json(m, fp, 1);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, m->path) != 0) {
+        fprintf(stderr, "Could not write %s\n", m->path);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Main loop: write the file if SIGUSR1 arrived since the last call */
+static void metrics_poll(Metrics *m)
+{
+    if (metrics_dump_requested && m->path) {
+        metrics_dump_requested = 0;
+        metrics_dump(m);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* On exit: the JSON line in bench mode, and METRICS_FILE if set */
+static void metrics_report(Metrics *m)
+{
+    if (m->bench) {
+        metrics_write_json(m, stdout, 0);
+        fflush(stdout);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (m->path) {
+        metrics_dump(m);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * Compressed packets of one stream, handed from the demuxer to that
+ * stream's decoder. The demuxer blocks once either the byte or the
+ * duration limit is reached; packets are moved, never copied.
+ */
+typedef struct PacketNode {
+    AVPacket *pkt;
+    struct PacketNode *next;
+} PacketNode;
+
+typedef struct {
+    PacketNode *first;
+    PacketNode *last;
+    int nb_packets;
+    int size;
+    double duration;
+    int max_size;
+    double max_duration;
+    double time_base;
+    int finished;
+    SDL_atomic_t abort;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+} PacketQueue;
+
+static int packet_queue_init(PacketQueue *q, int max_size,
+    double max_duration, AVRational time_base)
+{
+    SDL_memset(q, 0, sizeof(*q));
+    q->max_size = max_size;
+    q->max_duration = max_duration;
+    q->time_base = av_q2d(time_base);
+
+    q->mutex = SDL_CreateMutex();
+    q->cond = SDL_CreateCond();
+    if (!q->mutex || !q->cond) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+static void packet_queue_flush(PacketQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    while (q->first) {
+        PacketNode *node = q->first;
+        q->first = node->next;
+        av_packet_free(&node->pkt);
+        free(node);
+    }
+    q->last = NULL;
+    q->nb_packets = 0;
+    q->size = 0;
+    q->duration = 0.0;
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+static void packet_queue_destroy(PacketQueue *q)
+{
+    if (q->mutex) {
+        packet_queue_flush(q);
+        SDL_DestroyMutex(q->mutex);
+        q->mutex = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (q->cond) {
+        SDL_DestroyCond(q->cond);
+        q->cond = NULL;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* Demuxer: take ownership of 'src', waiting while the queue is full */
+static int packet_queue_put(PacketQueue *q, AVPacket *src)
+{
+    PacketNode *node = malloc(sizeof(PacketNode));
+    if (!node) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    node->pkt = av_packet_alloc();
+    node->next = NULL;
+    if (!node->pkt) {
+        free(node);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    av_packet_move_ref(node->pkt, src);
+
+    SDL_LockMutex(q->mutex);
+    while (!SDL_AtomicGet(&q->abort) && q->nb_packets > 0 &&
+           (q->size >= q->max_size || q->duration >= q->max_duration)) {
+        SDL_CondWait(q->cond, q->mutex);
+    }
+
+    if (SDL_AtomicGet(&q->abort)) {
+        SDL_UnlockMutex(q->mutex);
+        av_packet_free(&node->pkt);
+        free(node);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (q->last) {
+        q->last->next = node;
+    }
+    else {
+        q->first = node;
+    }
+    q->last = node;
+    q->nb_packets++;
+    q->size += node->pkt->size;
+    q->duration += node->pkt->duration * q->time_base;
+
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+
+    return 0;
+}
+
+/* Demuxer: no more packets will follow */
+static void packet_queue_finish(PacketQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    q->finished = 1;
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+/* Decoder: move the next packet into 'dst'; 1 = packet, 0 = EOF, -1 = abort */
+static int packet_queue_get(PacketQueue *q, AVPacket *dst)
+{
+    int ret;
+
+    SDL_LockMutex(q->mutex);
+    for (;;) {
+        if (SDL_AtomicGet(&q->abort)) {
+            ret = -1;
+            break;
+        }
+        else if (q->first) {
+            PacketNode *node = q->first;
+            q->first = node->next;
+            if (!q->first) {
+                q->last = NULL;
+            }
+            else {
+                /* nothing */
+            }
+            q->nb_packets--;
+            q->size -= node->pkt->size;
+            q->duration -= node->pkt->duration * q->time_base;
+
+            av_packet_move_ref(dst, node->pkt);
+            av_packet_free(&node->pkt);
+            free(node);
+
+            /* Wake the demuxer if it was waiting for room */
+            SDL_CondSignal(q->cond);
+            ret = 1;
+            break;
+        }
+        else if (q->finished) {
+            ret = 0;
+            break;
+        }
+        else {
+            SDL_CondWait(q->cond, q->mutex);
+        }
+    }
+    SDL_UnlockMutex(q->mutex);
+
+    return ret;
+}
+
+static void packet_queue_abort(PacketQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    SDL_AtomicSet(&q->abort, 1);
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+/* Demuxer and decoder stopped (after a seek): empty and reusable again */
+static void packet_queue_reset(PacketQueue *q)
+{
+    packet_queue_flush(q);
+
+    SDL_LockMutex(q->mutex);
+    q->finished = 0;
+    SDL_AtomicSet(&q->abort, 0);
+    SDL_UnlockMutex(q->mutex);
+}
+
+#endif
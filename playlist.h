@@ -0,0 +1,140 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Media for one process to play back to back, so going from one item to
+ * the next keeps SDL, the window and the audio device:
+ *   PLAYLIST       text file of media paths, one per line; blank lines
+ *                  and lines starting with '#' are skipped. Unset plays
+ *                  the player's own file once
+ *   PLAYLIST_LOOP  1 = start over after the last item, for ever
+ */
+typedef struct {
+    char **paths;
+    int count;
+    int cap;
+    int next;
+    int loop;
+} Playlist;
+
+static int playlist_add(Playlist *pl, const char *path)
+{
+    char *copy = NULL;
+
+    if (pl->count == pl->cap) {
+        int cap = pl->cap > 0 ? pl->cap * 2 : 16;
+        char **grown = realloc(pl->paths, cap * sizeof(char *));
+        if (!grown) {
+            return -1;
+        }
+        else {
+            pl->paths = grown;
+            pl->cap = cap;
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    copy = SDL_strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    else {
+        pl->paths[pl->count++] = copy;
+    }
+
+    return 0;
+}
+
+static void playlist_free(Playlist *pl)
+{
+    for (int i = 0; i < pl->count; i++) {
+        SDL_free(pl->paths[i]);
+    }
+
+    free(pl->paths);
+    SDL_memset(pl, 0, sizeof(*pl));
+}
+
+/* PLAYLIST's items, or just 'fallback'; -1 if that leaves nothing */
+static int playlist_load(Playlist *pl, const char *fallback)
+{
+    const char *file = getenv("PLAYLIST");
+    const char *loop = getenv("PLAYLIST_LOOP");
+    char line[4096];
+    FILE *fp;
+
+    SDL_memset(pl, 0, sizeof(*pl));
+
+    if (!file || !file[0]) {
+        return playlist_add(pl, fallback);
+    }
+    else {
+        pl->loop = loop && atoi(loop) > 0;
+    }
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open playlist %s\n", file);
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strcspn(line, "\r\n");
+
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') {
+            /* blank or comment */
+        }
+        else if (playlist_add(pl, line) < 0) {
+            fclose(fp);
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    fclose(fp);
+
+    if (pl->count == 0) {
+        fprintf(stderr, "Playlist %s is empty\n", file);
+        return -1;
+    }
+    else {
+        printf("Playlist: %d items%s\n", pl->count,
+            pl->loop ? ", looping" : "");
+    }
+
+    return 0;
+}
+
+/* Whether playlist_next has another item */
+static int playlist_more(const Playlist *pl)
+{
+    return pl->next < pl->count || (pl->loop && pl->count > 0);
+}
+
+/* The next item's path, or NULL after the last one */
+static const char *playlist_next(Playlist *pl)
+{
+    if (pl->next >= pl->count && pl->loop) {
+        pl->next = 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    return pl->next < pl->count ? pl->paths[pl->next++] : NULL;
+}
+
+#endif
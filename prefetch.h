@@ -0,0 +1,415 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include "audio_ring.h"
+#include "frame_source.h"
+
+/* Defaults for PREFETCH_FRAMES and PREFETCH_AUDIO_MS */
+#define PREFETCH_FRAMES_DEFAULT    16
+#define PREFETCH_AUDIO_MS_DEFAULT  500
+
+/*
+ * Read-ahead I/O thread for the raw players, so a slow read stalls this
+ * thread instead of the render loop:
+ *   PREFETCH_FRAMES    video frames faulted in ahead of the playhead
+ *   PREFETCH_AUDIO_MS  PCM read ahead into the audio ring
+ * Video frames stay in the FrameSource mapping: the thread touches every
+ * page of the frames ahead so the texture upload never waits on the disk.
+ * PCM is read straight into an AudioRing, whose only producer this thread
+ * then is. A stall is a frame (or audio chunk) the render loop needed
+ * before the thread had it ready.
+ */
+typedef struct {
+    FrameSource *video;
+    FILE *audio;
+    AudioRing *ring;
+    SDL_mutex *lock;
+    SDL_sem *wake;
+    SDL_Thread *thread;
+    int depth;
+    SDL_atomic_t quit;
+    SDL_atomic_t playhead;
+    SDL_atomic_t ready;
+    SDL_atomic_t video_stalls;
+    SDL_atomic_t audio_stalls;
+} Prefetch;
+
+static int prefetch_env(const char *name, int fallback)
+{
+    const char *env = getenv(name);
+
+    return env && atoi(env) > 0 ? atoi(env) : fallback;
+}
+
+/* AudioRing size for PREFETCH_AUDIO_MS at 'bytes_per_second' */
+static int prefetch_audio_bytes(int bytes_per_second)
+{
+    return (int)((Sint64)bytes_per_second *
+        prefetch_env("PREFETCH_AUDIO_MS", PREFETCH_AUDIO_MS_DEFAULT) / 1000);
+}
+
+/* Read one byte per page so the whole range is resident */
+static void prefetch_touch(const unsigned char *base, size_t from, size_t to)
+{
+    static long page;
+    volatile unsigned char sink = 0;
+
+    if (page == 0) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    else {
+        /* nothing */
+    }
+
+    for (size_t off = from; off < to; off += page) {
+        sink += base[off];
+    }
+    sink += base[to - 1];
+}
+
+/* Fault in the next frame ahead of the playhead; 0 when there is none */
+static int prefetch_video_step(Prefetch *p)
+{
+    FrameSource *src = p->video;
+    long next = SDL_AtomicGet(&p->ready);
+    long playhead = SDL_AtomicGet(&p->playhead);
+    size_t offset;
+
+    /* The render loop skipped ahead: frames behind it are not needed */
+    if (next < playhead) {
+        next = playhead;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (next >= playhead + p->depth) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Y4M: fault in the next FRAME marker outside the lock, so the
+     * render loop never waits on this thread's I/O */
+    SDL_LockMutex(p->lock);
+    if (src->y4m && next >= src->frame_count && !src->indexed_all) {
+        size_t marker = src->offsets[src->frame_count];
+
+        SDL_UnlockMutex(p->lock);
+        if (marker < src->map_size) {
+            prefetch_touch(src->base, marker, marker + 1);
+        }
+        else {
+            /* nothing */
+        }
+        SDL_LockMutex(p->lock);
+        frame_source_index(src, next);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (next >= src->frame_count) {
+        SDL_UnlockMutex(p->lock);
+        return 0;
+    }
+    else {
+        offset = frame_source_offset(src, next);
+        SDL_UnlockMutex(p->lock);
+    }
+
+    posix_fadvise(src->fd, offset, src->frame_size, POSIX_FADV_WILLNEED);
+    prefetch_touch(src->base, offset, offset + src->frame_size);
+
+    SDL_AtomicSet(&p->ready, next + 1);
+
+    return 1;
+}
+
+/* Top up the audio ring from the file; 0 when it is full or done */
+static int prefetch_audio_step(Prefetch *p)
+{
+    Uint8 *dst;
+    int space;
+
+    if (SDL_AtomicGet(&p->ring->finished)) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    space = audio_ring_write_ptr(p->ring, &dst);
+    if (space <= 0) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    size_t bytes_read = fread(dst, 1, space, p->audio);
+    if (bytes_read == 0) {
+        audio_ring_finish(p->ring);
+    }
+    else {
+        audio_ring_commit(p->ring, (int)bytes_read);
+    }
+
+    return 1;
+}
+
+static int prefetch_thread(void *arg)
+{
+    Prefetch *p = arg;
+
+    while (!SDL_AtomicGet(&p->quit)) {
+        int busy = 0;
+
+        /* Audio first: a gap is worse than a late frame */
+        if (p->ring && prefetch_audio_step(p)) {
+            busy = 1;
+        }
+        else {
+            /* nothing */
+        }
+
+        if (p->video && prefetch_video_step(p)) {
+            busy = 1;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* The render loop posts when the playhead moves; the timeout
+         * covers the audio callback draining the ring meanwhile */
+        if (!busy) {
+            SDL_SemWaitTimeout(p->wake, 5);
+            while (SDL_SemTryWait(p->wake) == 0) {
+                /* one wakeup is as good as many */
+            }
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return 0;
+}
+
+/* Start reading ahead in 'video' and/or 'audio' (into 'ring'); either
+ * may be NULL */
+static int prefetch_start(Prefetch *p, FrameSource *video, FILE *audio,
+    AudioRing *ring)
+{
+    SDL_memset(p, 0, sizeof(*p));
+    p->video = video;
+    p->audio = audio;
+    p->ring = audio ? ring : NULL;
+    p->depth = prefetch_env("PREFETCH_FRAMES", PREFETCH_FRAMES_DEFAULT);
+
+    if (video && video->fd >= 0) {
+        posix_fadvise(video->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (audio) {
+        posix_fadvise(fileno(audio), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    else {
+        /* nothing */
+    }
+
+    p->lock = SDL_CreateMutex();
+    p->wake = SDL_CreateSemaphore(0);
+    if (!p->lock || !p->wake) {
+        fprintf(stderr, "Could not create prefetch lock\n");
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    p->thread = SDL_CreateThread(prefetch_thread, "prefetch", p);
+    if (!p->thread) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+/* Render loop: frame_source_get, counting frames that were not ready */
+static int prefetch_get(Prefetch *p, long index,
+    const unsigned char **y, const unsigned char **u,
+    const unsigned char **v)
+{
+    int ret;
+
+    SDL_LockMutex(p->lock);
+    ret = frame_source_get(p->video, index, y, u, v);
+    SDL_UnlockMutex(p->lock);
+
+    if (ret == 0 && index >= SDL_AtomicGet(&p->ready)) {
+        SDL_AtomicAdd(&p->video_stalls, 1);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (index + 1 > SDL_AtomicGet(&p->playhead)) {
+        SDL_AtomicSet(&p->playhead, index + 1);
+        SDL_SemPost(p->wake);
+    }
+    else {
+        /* nothing */
+    }
+
+    return ret;
+}
+
+/* Render loop: take 'len' bytes of PCM, waiting for the thread if it
+ * fell behind; returns the bytes taken, short only at the end */
+static int prefetch_read_audio(Prefetch *p, Uint8 *dst, int len)
+{
+    int n = audio_ring_read(p->ring, dst, len);
+
+    if (n < len && !SDL_AtomicGet(&p->ring->finished)) {
+        SDL_AtomicAdd(&p->audio_stalls, 1);
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Check 'finished' before reading, so the last bytes are not lost */
+    while (n < len) {
+        int finished = SDL_AtomicGet(&p->ring->finished);
+
+        SDL_SemPost(p->wake);
+        n += audio_ring_read(p->ring, dst + n, len - n);
+        if (finished) {
+            break;
+        }
+        else if (n < len) {
+            SDL_Delay(1);
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    SDL_SemPost(p->wake);
+
+    return n;
+}
+
+/* Stop the thread and wait for its last read to land */
+static void prefetch_join(Prefetch *p)
+{
+    if (p->thread) {
+        SDL_AtomicSet(&p->quit, 1);
+        SDL_SemPost(p->wake);
+        SDL_WaitThread(p->thread, NULL);
+        p->thread = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    SDL_AtomicSet(&p->quit, 0);
+}
+
+/*
+ * Restart reading ahead at frame 'index' and byte 'audio_offset' of the
+ * PCM. The ring is emptied, so whoever consumes it must be stopped too
+ * (SDL_LockAudioDevice for the callback). Stall counts carry on.
+ */
+static int prefetch_seek(Prefetch *p, long index, Sint64 audio_offset)
+{
+    prefetch_join(p);
+
+    SDL_AtomicSet(&p->playhead, (int)index);
+    SDL_AtomicSet(&p->ready, (int)index);
+
+    if (p->ring) {
+        if (fseeko(p->audio, (off_t)audio_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "Could not seek audio to byte %lld\n",
+                (long long)audio_offset);
+        }
+        else {
+            /* nothing */
+        }
+        clearerr(p->audio);
+        audio_ring_reset(p->ring);
+    }
+    else {
+        /* nothing */
+    }
+
+    p->thread = SDL_CreateThread(prefetch_thread, "prefetch", p);
+    if (!p->thread) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+static void prefetch_stop(Prefetch *p)
+{
+    prefetch_join(p);
+
+    if (p->lock) {
+        SDL_DestroyMutex(p->lock);
+        p->lock = NULL;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (p->wake) {
+        SDL_DestroySemaphore(p->wake);
+        p->wake = NULL;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+static void prefetch_report(Prefetch *p)
+{
+    if (p->video) {
+        long ahead = SDL_AtomicGet(&p->ready) - SDL_AtomicGet(&p->playhead);
+
+        printf("Prefetch: %d frames deep, %ld ready at exit, "
+            "%d video stalls\n", p->depth, ahead > 0 ? ahead : 0,
+            SDL_AtomicGet(&p->video_stalls));
+    }
+    else {
+        /* nothing */
+    }
+
+    if (p->ring) {
+        printf("Prefetch: %d ms of audio, %d audio stalls\n",
+            prefetch_env("PREFETCH_AUDIO_MS", PREFETCH_AUDIO_MS_DEFAULT),
+            SDL_AtomicGet(&p->audio_stalls));
+    }
+    else {
+        /* nothing */
+    }
+}
+
+#endif
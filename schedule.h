@@ -0,0 +1,158 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+/* Sleep until this close to a deadline, then spin the rest */
+#define SCHEDULE_SPIN    0.002
+/* Shown later than this after its deadline (plus the vsync lead) */
+#define SCHEDULE_MISS    0.004
+/* Further behind than this, start the clock again instead of racing */
+#define SCHEDULE_RESYNC  0.250
+
+/*
+ * Presents each frame when its PTS falls due on the performance counter.
+ * Deadlines are anchor + (pts - anchor pts), never a sum of per-frame
+ * delays, so decode and upload time do not add up into drift and a
+ * variable frame rate plays at the speed it was recorded at.
+ *   VSYNC=1  present with vsync; frames are handed over half a refresh
+ *            early so the flip lands on the vblank nearest the deadline
+ */
+typedef struct {
+    Uint64 freq;
+    Uint64 anchor;
+    double anchor_pts;
+    int anchored;
+    double lead;
+    long frames;
+    long misses;
+    long resyncs;
+    double late_sum;
+    double late_max;
+} Schedule;
+
+/* Renderer flag for VSYNC=1 */
+static Uint32 schedule_vsync_flag(void)
+{
+    const char *env = getenv("VSYNC");
+
+    return env && atoi(env) > 0 ? SDL_RENDERER_PRESENTVSYNC : 0;
+}
+
+/* 'vsync' as from schedule_vsync_flag; the refresh rate comes from the
+ * display 'window' is on */
+static void schedule_init(Schedule *s, SDL_Window *window, Uint32 vsync)
+{
+    SDL_DisplayMode mode;
+
+    SDL_memset(s, 0, sizeof(*s));
+    s->freq = SDL_GetPerformanceFrequency();
+
+    if (vsync && window && SDL_GetWindowDisplayMode(window, &mode) == 0 &&
+        mode.refresh_rate > 0) {
+        s->lead = 0.5 / mode.refresh_rate;
+        printf("Schedule: vsync at %d Hz\n", mode.refresh_rate);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* 'pts' (in seconds) is due right now; later deadlines follow from it */
+static void schedule_anchor(Schedule *s, double pts)
+{
+    s->anchor = SDL_GetPerformanceCounter();
+    s->anchor_pts = pts;
+    s->anchored = 1;
+}
+
+/* Forget the anchor, e.g. after a seek: the next frame is due at once */
+static void schedule_reset(Schedule *s)
+{
+    s->anchored = 0;
+}
+
+/* Seconds until the frame at 'pts' should be handed over; <= 0 when due */
+static double schedule_due(Schedule *s, double pts)
+{
+    Sint64 elapsed;
+
+    if (!s->anchored) {
+        schedule_anchor(s, pts);
+    }
+    else {
+        /* nothing */
+    }
+
+    elapsed = (Sint64)(SDL_GetPerformanceCounter() - s->anchor);
+
+    return (pts - s->anchor_pts) - (double)elapsed / s->freq - s->lead;
+}
+
+/* Wait towards the deadline for 'pts': sleep for at most 'max_ms' while
+ * it is far, and spin the last SCHEDULE_SPIN so the wakeup is exact */
+static void schedule_wait(Schedule *s, double pts, Uint32 max_ms)
+{
+    double left = schedule_due(s, pts);
+
+    if (left > SCHEDULE_SPIN) {
+        Uint32 ms = (Uint32)((left - SCHEDULE_SPIN) * 1000.0);
+
+        SDL_Delay(ms < max_ms ? ms : max_ms);
+    }
+    else {
+        while (schedule_due(s, pts) > 0.0) {
+            /* spin */
+        }
+    }
+}
+
+/* The frame at 'pts' just went on screen: account for how late it was */
+static void schedule_presented(Schedule *s, double pts)
+{
+    double late = -(schedule_due(s, pts) + s->lead);
+
+    s->frames++;
+    if (late > 0.0) {
+        s->late_sum += late;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (late > s->late_max) {
+        s->late_max = late;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (late > SCHEDULE_MISS + s->lead) {
+        s->misses++;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* A long stall: carry on from here rather than rush to catch up */
+    if (late > SCHEDULE_RESYNC) {
+        schedule_anchor(s, pts);
+        s->resyncs++;
+    }
+    else {
+        /* nothing */
+    }
+}
+
+static void schedule_report(Schedule *s)
+{
+    printf("Schedule: %ld frames, %ld deadline misses (> %.1f ms late), "
+        "%ld resyncs, mean %.2f ms late, worst %.1f ms\n", s->frames,
+        s->misses, (SCHEDULE_MISS + s->lead) * 1000.0, s->resyncs,
+        s->frames > 0 ? s->late_sum * 1000.0 / s->frames : 0.0,
+        s->late_max * 1000.0);
+}
+
+#endif
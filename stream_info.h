@@ -0,0 +1,383 @@
+#ifndef STREAM_INFO_H
+#define STREAM_INFO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include "metrics.h"
+
+/* Sidecar next to the media: "<media>.sinfo" */
+#define STREAM_INFO_SUFFIX   ".sinfo"
+#define STREAM_INFO_VERSION  1
+
+/* Probe limits in fast-open mode: bytes read, and microseconds of media */
+#define STREAM_INFO_PROBESIZE   (64 * 1024)
+#define STREAM_INFO_ANALYZE_US  100000
+
+/*
+ * avformat_find_stream_info reads and decodes the start of every stream
+ * to fill in what the container header leaves out (pixel and sample
+ * formats, channel layout, frame rate), by default up to 5 MB or 5 s of
+ * media. On a large or remote file that is most of the startup time.
+ *   FAST_OPEN=1  probe with STREAM_INFO_PROBESIZE/STREAM_INFO_ANALYZE_US
+ *                (a full probe again if that leaves a stream incomplete)
+ *                and keep the result in a sidecar; later opens of the
+ *                unchanged file take the codec parameters from there and
+ *                do not probe at all
+ * The sidecar is text:
+ *   SINFO <version> <media size> <media mtime> <streams> <start time>
+ *         <duration>
+ *   <type> <codec id> <format> <width> <height> <sample rate> <channels>
+ *   <channel layout> <profile> <level> <bit rate> <frame rate num>
+ *   <frame rate den> <extradata size> <extradata hex>   (one per stream)
+ * and is rewritten whenever the media's size or mtime no longer match.
+ */
+static int stream_info_fast(void)
+{
+    const char *env = getenv("FAST_OPEN");
+
+    return env && atoi(env) > 0;
+}
+
+/* Everything the players need to open a decoder and its output is known */
+static int stream_info_complete(AVFormatContext *fmt_ctx)
+{
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        AVCodecParameters *par = fmt_ctx->streams[i]->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (par->format < 0 || par->width <= 0 || par->height <= 0)) {
+            return 0;
+        }
+        else if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+                 (par->format < 0 || par->sample_rate <= 0 ||
+                  par->channels <= 0)) {
+            return 0;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return 1;
+}
+
+/* Fill in one stream from its sidecar line; the header's own values win.
+ * -1 if the line is unreadable or describes another stream */
+static int stream_info_load_stream(FILE *fp, AVStream *st)
+{
+    AVCodecParameters *par = st->codecpar;
+    int type;
+    int codec_id;
+    int format;
+    int width;
+    int height;
+    int sample_rate;
+    int channels;
+    uint64_t layout;
+    int profile;
+    int level;
+    int64_t bit_rate;
+    AVRational rate;
+    int size;
+    uint8_t *extradata = NULL;
+
+    if (fscanf(fp, "%d %d %d %d %d %d %d %" SCNu64 " %d %d %" SCNd64
+            " %d %d %d", &type, &codec_id, &format, &width, &height,
+            &sample_rate, &channels, &layout, &profile, &level, &bit_rate,
+            &rate.num, &rate.den, &size) != 14 ||
+        type != (int)par->codec_type || codec_id != (int)par->codec_id ||
+        size < 0 || size > 1024 * 1024) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (size > 0) {
+        extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!extradata) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int i = 0; i < size; i++) {
+        unsigned int byte;
+
+        if (fscanf(fp, "%2x", &byte) != 1) {
+            av_free(extradata);
+            return -1;
+        }
+        else {
+            extradata[i] = (uint8_t)byte;
+        }
+    }
+
+    if (par->format < 0) {
+        par->format = format;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->width <= 0 || par->height <= 0) {
+        par->width = width;
+        par->height = height;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->sample_rate <= 0) {
+        par->sample_rate = sample_rate;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->channels <= 0) {
+        par->channels = channels;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->channel_layout == 0) {
+        par->channel_layout = layout;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->profile == FF_PROFILE_UNKNOWN) {
+        par->profile = profile;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->level == FF_LEVEL_UNKNOWN) {
+        par->level = level;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->bit_rate <= 0) {
+        par->bit_rate = bit_rate;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (st->avg_frame_rate.num == 0 && rate.num > 0 && rate.den > 0) {
+        st->avg_frame_rate = rate;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (par->extradata_size == 0 && extradata) {
+        par->extradata = extradata;
+        par->extradata_size = size;
+    }
+    else {
+        av_free(extradata);
+    }
+
+    return 0;
+}
+
+static int stream_info_load(AVFormatContext *fmt_ctx, const char *sidecar,
+    const struct stat *media)
+{
+    FILE *fp = fopen(sidecar, "r");
+    int version;
+    long long size;
+    long long mtime;
+    int streams;
+    int64_t start_time;
+    int64_t duration;
+    int ret = -1;
+
+    if (!fp) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (fscanf(fp, "SINFO %d %lld %lld %d %" SCNd64 " %" SCNd64, &version,
+            &size, &mtime, &streams, &start_time, &duration) != 6 ||
+        version != STREAM_INFO_VERSION ||
+        size != (long long)media->st_size ||
+        mtime != (long long)media->st_mtime ||
+        streams != (int)fmt_ctx->nb_streams) {
+        /* stale or foreign: probe */
+        goto cleanup;
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int i = 0; i < streams; i++) {
+        if (stream_info_load_stream(fp, fmt_ctx->streams[i]) < 0) {
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (fmt_ctx->start_time == AV_NOPTS_VALUE) {
+        fmt_ctx->start_time = start_time;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (fmt_ctx->duration == AV_NOPTS_VALUE) {
+        fmt_ctx->duration = duration;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* A sidecar written by an older build may still be short of
+     * something: probe rather than open a decoder half blind */
+    ret = stream_info_complete(fmt_ctx) ? 0 : -1;
+
+cleanup:
+    fclose(fp);
+
+    return ret;
+}
+
+/* Write via a temporary, so a reader never sees half a sidecar */
+static void stream_info_save(AVFormatContext *fmt_ctx, const char *sidecar,
+    const struct stat *media)
+{
+    char tmp[4096];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sidecar);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write %s\n", tmp);
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    fprintf(fp, "SINFO %d %lld %lld %d %" PRId64 " %" PRId64 "\n",
+        STREAM_INFO_VERSION, (long long)media->st_size,
+        (long long)media->st_mtime, (int)fmt_ctx->nb_streams,
+        fmt_ctx->start_time, fmt_ctx->duration);
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        AVStream *st = fmt_ctx->streams[i];
+        AVCodecParameters *par = st->codecpar;
+
+        fprintf(fp, "%d %d %d %d %d %d %d %" PRIu64 " %d %d %" PRId64
+            " %d %d %d ", (int)par->codec_type, (int)par->codec_id,
+            par->format, par->width, par->height, par->sample_rate,
+            par->channels, par->channel_layout, par->profile, par->level,
+            par->bit_rate, st->avg_frame_rate.num, st->avg_frame_rate.den,
+            par->extradata_size);
+        for (int b = 0; b < par->extradata_size; b++) {
+            fprintf(fp, "%02x", par->extradata[b]);
+        }
+        fprintf(fp, "\n");
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, sidecar) != 0) {
+        fprintf(stderr, "Could not write %s\n", sidecar);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/*
+ * In place of avformat_find_stream_info on 'fmt_ctx', just opened from
+ * 'path': a full probe, or with FAST_OPEN the sidecar or a short probe.
+ * How it went and how long it took goes to 'm'.
+ */
+static int stream_info_find(AVFormatContext *fmt_ctx, const char *path,
+    Metrics *m)
+{
+    char sidecar[4096];
+    struct stat media;
+    Uint64 start = SDL_GetPerformanceCounter();
+    const char *how = "probed";
+    int have_stat = stat(path, &media) == 0;
+
+    snprintf(sidecar, sizeof(sidecar), "%s%s", path, STREAM_INFO_SUFFIX);
+
+    if (!stream_info_fast()) {
+        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+    }
+    else if (have_stat && stream_info_load(fmt_ctx, sidecar, &media) == 0) {
+        how = "cached";
+    }
+    else {
+        how = "fast probe";
+        fmt_ctx->probesize = STREAM_INFO_PROBESIZE;
+        fmt_ctx->max_analyze_duration = STREAM_INFO_ANALYZE_US;
+        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+            return -1;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Streams the short probe could not pin down get the full one */
+        if (!stream_info_complete(fmt_ctx)) {
+            how = "fast probe, then full";
+            fmt_ctx->probesize = 5000000;
+            fmt_ctx->max_analyze_duration = 0;
+            if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+                return -1;
+            }
+            else {
+                /* nothing */
+            }
+        }
+        else {
+            /* nothing */
+        }
+
+        if (have_stat && stream_info_complete(fmt_ctx)) {
+            stream_info_save(fmt_ctx, sidecar, &media);
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+        SDL_GetPerformanceFrequency();
+
+    printf("Stream info %s: %d streams, %.1f ms\n", how,
+        (int)fmt_ctx->nb_streams, ms);
+    metrics_open(m, how, ms);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef TEXTURE_POOL_H
+#define TEXTURE_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
+#include "frame_queue.h"
+
+/* Most textures a pool holds */
+#define TEXTURE_POOL_MAX   64
+
+/* Reference frames to allow for when the decoder has not said yet: the
+ * most H.264 and HEVC keep */
+#define TEXTURE_POOL_REFS  16
+
+enum {
+    TEXTURE_FREE,       /* locked, ready for the decoder */
+    TEXTURE_BUSY,       /* referenced by one or more decoded frames */
+    TEXTURE_RELEASED    /* decoder let go, render thread must re-lock */
+};
+
+/*
+ * Streaming YV12 textures the decoder decodes straight into. A texture is
+ * kept locked while the decoder owns it; the render thread unlocks it
+ * (which uploads it) to present, and locks it again once the last frame
+ * referencing it has been freed. Textures are only locked and unlocked on
+ * the render thread; the decoder threads claim and release them through
+ * the atomic state.
+ */
+typedef struct {
+    SDL_Texture *texture;
+    uint8_t *pixels;
+    int pitch;
+    int locked;
+    SDL_atomic_t state;
+} TextureSlot;
+
+typedef struct {
+    TextureSlot slots[TEXTURE_POOL_MAX];
+    int count;
+    int width;
+    int height;
+    SDL_atomic_t misses;
+} TexturePool;
+
+static void texture_pool_release(void *opaque, uint8_t *data)
+{
+    TextureSlot *slot = opaque;
+    (void)data;
+
+    SDL_AtomicSet(&slot->state, TEXTURE_RELEASED);
+}
+
+/* get_buffer2: hand out a locked texture, or fall back to the default */
+static int texture_pool_get_buffer(AVCodecContext *ctx, AVFrame *frame,
+    int flags)
+{
+    TexturePool *pool = ctx->opaque;
+    TextureSlot *slot = NULL;
+    int align[AV_NUM_DATA_POINTERS];
+    int w = frame->width;
+    int h = frame->height;
+
+    /* Full range needs squeezing before SDL can show it (frame_format.h),
+     * so only limited-range I420 is decoded in place */
+    if (!pool || pool->count == 0 ||
+        !(ctx->codec->capabilities & AV_CODEC_CAP_DR1) ||
+        frame->format != AV_PIX_FMT_YUV420P ||
+        frame->color_range == AVCOL_RANGE_JPEG) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    else {
+        /* nothing */
+    }
+
+    avcodec_align_dimensions2(ctx, &w, &h, align);
+    if (w > pool->width || h > pool->height) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int i = 0; i < pool->count && !slot; i++) {
+        if (SDL_AtomicCAS(&pool->slots[i].state, TEXTURE_FREE,
+                TEXTURE_BUSY)) {
+            slot = &pool->slots[i];
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    if (!slot) {
+        SDL_AtomicAdd(&pool->misses, 1);
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    else {
+        /* nothing */
+    }
+
+    /* YV12 layout: Y plane, then V, then U at half pitch and height */
+    int pitch = slot->pitch;
+    int chroma_pitch = (pitch + 1) / 2;
+    uint8_t *y = slot->pixels;
+    uint8_t *v = y + (size_t)pitch * pool->height;
+    uint8_t *u = v + (size_t)chroma_pitch * ((pool->height + 1) / 2);
+
+    /* The decoder needs aligned planes and strides */
+    if (pitch % align[0] || chroma_pitch % align[1] ||
+        (uintptr_t)y % align[0] || (uintptr_t)u % align[1] ||
+        (uintptr_t)v % align[2]) {
+        SDL_AtomicSet(&slot->state, TEXTURE_FREE);
+        SDL_AtomicAdd(&pool->misses, 1);
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    else {
+        /* nothing */
+    }
+
+    frame->buf[0] = av_buffer_create(y,
+        (size_t)pitch * pool->height +
+        2 * (size_t)chroma_pitch * ((pool->height + 1) / 2),
+        texture_pool_release, slot, 0);
+    if (!frame->buf[0]) {
+        SDL_AtomicSet(&slot->state, TEXTURE_FREE);
+        return AVERROR(ENOMEM);
+    }
+    else {
+        /* nothing */
+    }
+
+    frame->data[0] = y;
+    frame->data[1] = u;
+    frame->data[2] = v;
+    frame->linesize[0] = pitch;
+    frame->linesize[1] = chroma_pitch;
+    frame->linesize[2] = chroma_pitch;
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+/* Install the allocator on a further decoder of a pool that may already
+ * be initialized; frames that do not fit its textures fall back */
+static void texture_pool_share(TexturePool *pool, AVCodecContext *ctx)
+{
+    ctx->opaque = pool;
+    ctx->get_buffer2 = texture_pool_get_buffer;
+}
+
+/* Install the allocator; the pool stays empty until texture_pool_init */
+static void texture_pool_attach(TexturePool *pool, AVCodecContext *ctx)
+{
+    SDL_memset(pool, 0, sizeof(*pool));
+    texture_pool_share(pool, ctx);
+}
+
+/*
+ * Textures one decoder can hold at once: the display queue, its reference
+ * frames, and with frame threading one frame in flight per thread, plus
+ * the one being decoded
+ */
+static int texture_pool_needed(AVCodecContext *ctx)
+{
+    int refs = ctx->refs > 1 ? ctx->refs : TEXTURE_POOL_REFS;
+    int threads = ctx->active_thread_type & FF_THREAD_FRAME ?
+        ctx->thread_count : 0;
+
+    return FRAME_QUEUE_SIZE + refs + threads + 1;
+}
+
+/* Render thread: create and lock the textures for an opened decoder and
+ * 'decoders' - 1 more like it sharing the pool */
+static void texture_pool_init(TexturePool *pool, SDL_Renderer *renderer,
+    AVCodecContext *ctx, int decoders)
+{
+    SDL_RendererInfo info = { 0 };
+    int align[AV_NUM_DATA_POINTERS];
+    int w = ctx->coded_width > ctx->width ? ctx->coded_width : ctx->width;
+    int h = ctx->coded_height > ctx->height ?
+        ctx->coded_height : ctx->height;
+    int size = texture_pool_needed(ctx) * decoders;
+
+    /* Only renderers whose locked memory outlives the unlock: the
+     * decoder may still read a frame as a reference after it is shown */
+    if (SDL_GetRendererInfo(renderer, &info) < 0 ||
+        (strcmp(info.name, "opengl") != 0 &&
+         strcmp(info.name, "opengles2") != 0 &&
+         strcmp(info.name, "software") != 0)) {
+        printf("Zero-copy decode: disabled (%s renderer)\n",
+            info.name ? info.name : "unknown");
+        return;
+    }
+    else {
+        /* nothing */
+    }
+
+    avcodec_align_dimensions2(ctx, &w, &h, align);
+    pool->width = FFALIGN(w, 2 * align[0]);
+    pool->height = FFALIGN(h, 2);
+
+    if (size > TEXTURE_POOL_MAX) {
+        size = TEXTURE_POOL_MAX;
+    }
+    else {
+        /* nothing */
+    }
+
+    for (int i = 0; i < size; i++) {
+        TextureSlot *slot = &pool->slots[i];
+        void *pixels;
+
+        slot->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
+            SDL_TEXTUREACCESS_STREAMING, pool->width, pool->height);
+        if (!slot->texture) {
+            break;
+        }
+        else {
+            /* nothing */
+        }
+
+        if (SDL_LockTexture(slot->texture, NULL, &pixels,
+                &slot->pitch) < 0) {
+            SDL_DestroyTexture(slot->texture);
+            slot->texture = NULL;
+            break;
+        }
+        else {
+            /* nothing */
+        }
+
+        slot->pixels = pixels;
+        slot->locked = 1;
+        SDL_AtomicSet(&slot->state, TEXTURE_FREE);
+        pool->count++;
+    }
+
+    printf("Zero-copy decode: %d textures of %dx%d\n", pool->count,
+        pool->width, pool->height);
+}
+
+/* Render thread: the pool slot 'frame' was decoded into, or NULL */
+static TextureSlot *texture_pool_slot(TexturePool *pool, AVFrame *frame)
+{
+    void *opaque = frame->buf[0] ? av_buffer_get_opaque(frame->buf[0]) :
+        NULL;
+
+    for (int i = 0; i < pool->count; i++) {
+        if (opaque == &pool->slots[i]) {
+            return &pool->slots[i];
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return NULL;
+}
+
+/* Render thread: unlock (upload) a decoded slot and return its texture */
+static SDL_Texture *texture_pool_present(TextureSlot *slot)
+{
+    if (slot->locked) {
+        SDL_UnlockTexture(slot->texture);
+        slot->locked = 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    return slot->texture;
+}
+
+/* Render thread: lock released slots again and hand them back */
+static void texture_pool_recycle(TexturePool *pool)
+{
+    for (int i = 0; i < pool->count; i++) {
+        TextureSlot *slot = &pool->slots[i];
+        void *pixels;
+
+        if (SDL_AtomicGet(&slot->state) != TEXTURE_RELEASED) {
+            continue;
+        }
+        else {
+            /* nothing */
+        }
+
+        if (!slot->locked) {
+            if (SDL_LockTexture(slot->texture, NULL, &pixels,
+                    &slot->pitch) < 0) {
+                continue;
+            }
+            else {
+                slot->pixels = pixels;
+                slot->locked = 1;
+            }
+        }
+        else {
+            /* never shown (dropped), still locked */
+        }
+
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&slot->state, TEXTURE_FREE);
+    }
+}
+
+/* Render thread: destroy the textures once the decoder threads are gone */
+static void texture_pool_destroy(TexturePool *pool)
+{
+    int count = pool->count;
+
+    pool->count = 0;
+    for (int i = 0; i < count; i++) {
+        TextureSlot *slot = &pool->slots[i];
+
+        if (slot->locked) {
+            SDL_UnlockTexture(slot->texture);
+        }
+        else {
+            /* nothing */
+        }
+
+        SDL_DestroyTexture(slot->texture);
+    }
+}
+
+#endif
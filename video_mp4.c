@@ -2,11 +2,163 @@
 #include <SDL2/SDL.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
+#include "decode_threads.h"
+#include "frame_format.h"
+#include "frame_queue.h"
+#include "kf_index.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "stream_info.h"
+#include "texture_pool.h"
+#include "yuv_rgb.h"
 
 #define VIDEO_FILE "video.mp4"
 #define WIDTH  640
 #define HEIGHT 480
+#define SEEK_SHORT  5.0
+#define SEEK_LONG   60.0
+
+typedef struct {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *codec_ctx;
+    int video_stream;
+    FrameQueue queue;
+    KfIndex index;
+    int64_t skip_until;
+    int frames_skipped;
+    Metrics *metrics;
+} Decoder;
+
+/* Frames between a seek's keyframe and its target are decoded only */
+static int decode_skip(Decoder *dec, AVFrame *frame)
+{
+    if (dec->skip_until == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    else if (frame_queue_time(frame) != AV_NOPTS_VALUE &&
+             frame_queue_time(frame) < dec->skip_until) {
+        dec->frames_skipped++;
+        return 1;
+    }
+    else {
+        dec->skip_until = AV_NOPTS_VALUE;
+        return 0;
+    }
+}
+
+/* Decode thread: demux and decode into the frame queue until EOF */
+static int decode_thread(void *arg)
+{
+    Decoder *dec = arg;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int quit = 0;
+    Uint64 t;
+
+    if (!packet || !frame) {
+        fprintf(stderr, "Could not allocate frame/packet\n");
+        quit = 1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* Time spent blocked on a full queue is charged to no stage */
+    t = metrics_begin();
+    while (!quit && av_read_frame(dec->fmt_ctx, packet) >= 0) {
+        t = metrics_end(dec->metrics, METRICS_READ, t);
+
+        if (packet->stream_index == dec->video_stream) {
+            Uint64 decode = 0;
+
+            if (avcodec_send_packet(dec->codec_ctx, packet) >= 0) {
+                while (!quit &&
+                       avcodec_receive_frame(dec->codec_ctx, frame) >= 0) {
+                    metrics_lap(&decode, t);
+                    if (decode_skip(dec, frame)) {
+                        av_frame_unref(frame);
+                    }
+                    else if (frame_queue_push(&dec->queue, frame) < 0) {
+                        quit = 1;
+                    }
+                    else {
+                        /* nothing */
+                    }
+                    t = metrics_begin();
+                }
+            }
+            else {
+                /* decode error, skip frame */
+            }
+            t = metrics_lap(&decode, t);
+            metrics_add(dec->metrics, METRICS_DECODE, decode);
+        }
+        else {
+            /* not video packet */
+        }
+
+        av_packet_unref(packet);
+    }
+
+    /* Drain frames still buffered in the decoder, timed as one packet */
+    Uint64 decode = 0;
+    t = metrics_begin();
+    if (!quit && avcodec_send_packet(dec->codec_ctx, NULL) >= 0) {
+        while (!quit && avcodec_receive_frame(dec->codec_ctx, frame) >= 0) {
+            metrics_lap(&decode, t);
+            if (decode_skip(dec, frame)) {
+                av_frame_unref(frame);
+            }
+            else if (frame_queue_push(&dec->queue, frame) < 0) {
+                quit = 1;
+            }
+            else {
+                /* nothing */
+            }
+            t = metrics_begin();
+        }
+        metrics_lap(&decode, t);
+        metrics_add(dec->metrics, METRICS_DECODE, decode);
+    }
+    else {
+        /* nothing */
+    }
+
+    frame_queue_finish(&dec->queue);
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+
+    return 0;
+}
+
+/*
+ * Stop the decode thread, put the demuxer on the keyframe before
+ * 'seconds' and start decoding forward from there; returns the new
+ * thread. A drained decoder must be reopened for more input, so it is
+ * flushed either way.
+ */
+static SDL_Thread *decode_seek(Decoder *dec, SDL_Thread *thread,
+    double seconds)
+{
+    frame_queue_abort(&dec->queue);
+    SDL_WaitThread(thread, NULL);
+
+    frame_queue_reset(&dec->queue);
+    avcodec_flush_buffers(dec->codec_ctx);
+    dec->skip_until = kf_index_seek(&dec->index, dec->fmt_ctx,
+        dec->video_stream, seconds);
+
+    thread = SDL_CreateThread(decode_thread, "decode", dec);
+    if (!thread) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
+    }
+    else {
+        /* nothing */
+    }
+
+    return thread;
+}
 
 int main(void)
 {
@@ -14,14 +166,27 @@ int main(void)
     AVCodecContext *codec_ctx = NULL;
     const AVCodec *codec = NULL;
     AVFrame *frame = NULL;
-    AVPacket *packet = NULL;
-    struct SwsContext *sws_ctx = NULL;
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
-    SDL_Texture *texture = NULL;
+    SDL_Thread *thread = NULL;
+    Decoder dec;
+    TexturePool pool;
+    FrameFormat ff;
+    YuvRgb rgb;
+    Schedule sched;
+    Metrics metrics;
     int video_stream = -1;
+    int seeks = 0;
+    int out_width = 0;
+    int out_height = 0;
     int ret = 1;
 
+    SDL_memset(&dec, 0, sizeof(dec));
+    dec.skip_until = AV_NOPTS_VALUE;
+    SDL_memset(&pool, 0, sizeof(pool));
+    SDL_memset(&ff, 0, sizeof(ff));
+    metrics_init(&metrics, "video_mp4");
+
     /* Open video file */
     if (avformat_open_input(&fmt_ctx, VIDEO_FILE, NULL, NULL) < 0) {
         fprintf(stderr, "Could not open %s\n", VIDEO_FILE);
@@ -31,7 +196,7 @@ int main(void)
         /* nothing */
     }
 
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    if (stream_info_find(fmt_ctx, VIDEO_FILE, &metrics) < 0) {
         fprintf(stderr, "Could not find stream info\n");
         goto cleanup;
     }
@@ -86,6 +251,14 @@ int main(void)
         /* nothing */
     }
 
+    decode_threads_configure(codec_ctx);
+    texture_pool_attach(&pool, codec_ctx);
+
+    /* Decoders that can decode at a fraction of the size skip the
+     * detail the window cannot show */
+    codec_ctx->lowres = frame_format_lowres(codec, codec_ctx->width,
+        codec_ctx->height, WIDTH, HEIGHT);
+
     if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         goto cleanup;
@@ -94,6 +267,17 @@ int main(void)
         /* nothing */
     }
 
+    decode_threads_report(codec_ctx);
+
+    /* Keyframes for seeking: the sidecar when it is fresh, otherwise
+     * built in the background while playback starts */
+    if (kf_index_open(&dec.index, VIDEO_FILE, video_stream) < 0) {
+        fprintf(stderr, "No keyframe index, seeks use the demuxer's own\n");
+    }
+    else {
+        /* nothing */
+    }
+
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
@@ -105,7 +289,7 @@ int main(void)
 
     window = SDL_CreateWindow("Video Player",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WIDTH, HEIGHT, 0);
+        WIDTH, HEIGHT, SDL_WINDOW_RESIZABLE);
     if (!window) {
         fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
         goto cleanup;
@@ -114,69 +298,200 @@ int main(void)
         /* nothing */
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (!renderer) {
-        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
-        goto cleanup;
+    /* YUV_RGB converts into the window surface, which rules out a
+     * renderer on the same window; the surface is not scaled, so the
+     * window takes the video's size */
+    if (yuv_rgb_init(&rgb, window, codec_ctx->height)) {
+        SDL_SetWindowSize(window, codec_ctx->width, codec_ctx->height);
+        frame_format_init(&ff, NULL, codec_ctx->thread_count);
     }
     else {
-        /* nothing */
+        renderer = SDL_CreateRenderer(window, -1,
+            SDL_RENDERER_ACCELERATED | schedule_vsync_flag());
+        if (!renderer) {
+            fprintf(stderr, "Could not create renderer: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* A texture in the decoder's own layout where SDL has one; a
+         * decoder that only knows once it decodes negotiates then */
+        frame_format_init(&ff, renderer, codec_ctx->thread_count);
+        SDL_GetRendererOutputSize(renderer, &out_width, &out_height);
+        frame_format_set_output(&ff, out_width, out_height);
+        if (codec_ctx->pix_fmt != AV_PIX_FMT_NONE &&
+            frame_format_open(&ff, codec_ctx->pix_fmt,
+                frame_format_full_range(codec_ctx->pix_fmt,
+                    codec_ctx->color_range),
+                codec_ctx->width, codec_ctx->height) < 0) {
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Decode straight into locked textures where the renderer
+         * allows, unless every frame gets scaled down anyway */
+        if (frame_format_scales(&ff, codec_ctx->width, codec_ctx->height)) {
+            printf("Zero-copy decode: disabled (downscaling)\n");
+        }
+        else {
+            texture_pool_init(&pool, renderer, codec_ctx, 1);
+        }
     }
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
-        SDL_TEXTUREACCESS_STREAMING, codec_ctx->width, codec_ctx->height);
-    if (!texture) {
-        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
+    /* Start decode thread */
+    dec.fmt_ctx = fmt_ctx;
+    dec.codec_ctx = codec_ctx;
+    dec.video_stream = video_stream;
+    dec.metrics = &metrics;
+    if (frame_queue_init(&dec.queue) < 0) {
+        fprintf(stderr, "Could not allocate frame queue\n");
         goto cleanup;
     }
     else {
         /* nothing */
     }
 
-    /* Allocate frame and packet */
-    frame = av_frame_alloc();
-    packet = av_packet_alloc();
-    if (!frame || !packet) {
-        fprintf(stderr, "Could not allocate frame/packet\n");
+    thread = SDL_CreateThread(decode_thread, "decode", &dec);
+    if (!thread) {
+        fprintf(stderr, "Could not create thread: %s\n", SDL_GetError());
         goto cleanup;
     }
     else {
         /* nothing */
     }
 
-    /* Calculate frame delay from framerate */
+    /* Nominal frame duration, for frames that come without a timestamp */
     AVRational fr = fmt_ctx->streams[video_stream]->avg_frame_rate;
-    int frame_delay_ms = (fr.num > 0) ? (1000 * fr.den / fr.num) : 33;
+    double frame_delay = (fr.num > 0) ? av_q2d(av_inv_q(fr)) : 1.0 / 30;
+
+    schedule_init(&sched, window, renderer ? schedule_vsync_flag() : 0);
 
-    /* Main loop */
+    /* Main loop: present queued frames when their PTS falls due */
     SDL_Event event;
     int quit = 0;
+    double video_tb = av_q2d(fmt_ctx->streams[video_stream]->time_base);
+    double position = 0.0;
+    double pts = 0.0;
+    Uint64 seek_start = 0;
+
+    while (!quit && !frame_queue_done(&dec.queue)) {
+        frame = frame_queue_peek(&dec.queue);
+        if (frame) {
+            pts = frame_queue_time(frame) != AV_NOPTS_VALUE ?
+                frame_queue_time(frame) * video_tb :
+                position + frame_delay;
+        }
+        else {
+            /* nothing */
+        }
 
-    while (!quit && av_read_frame(fmt_ctx, packet) >= 0) {
-        if (packet->stream_index == video_stream) {
-            if (avcodec_send_packet(codec_ctx, packet) >= 0) {
-                while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
-                    /* Update texture with YUV data */
-                    SDL_UpdateYUVTexture(texture, NULL,
-                        frame->data[0], frame->linesize[0],
-                        frame->data[1], frame->linesize[1],
-                        frame->data[2], frame->linesize[2]);
-
-                    SDL_RenderClear(renderer);
-                    SDL_RenderCopy(renderer, texture, NULL, NULL);
-                    SDL_RenderPresent(renderer);
-                    SDL_Delay(frame_delay_ms);
+        /* Bench mode shows frames as fast as they are decoded */
+        if (frame && (metrics.bench || schedule_due(&sched, pts) <= 0.0)) {
+            Uint64 t = metrics_begin();
+
+            if (rgb.window) {
+                /* Convert into the window surface in the stream's own
+                 * colours; unlabelled HD is taken to be BT.709 */
+                int matrix = frame->colorspace == AVCOL_SPC_BT709 ||
+                    (frame->colorspace == AVCOL_SPC_UNSPECIFIED &&
+                     frame->height >= 720) ? 709 : 601;
+                int full_range = frame->color_range == AVCOL_RANGE_JPEG ||
+                    frame->format == AV_PIX_FMT_YUVJ420P;
+
+                if (matrix != rgb.matrix || full_range != rgb.full_range) {
+                    yuv_rgb_set_matrix(&rgb, matrix, full_range);
+                }
+                else {
+                    /* nothing */
                 }
+
+                AVFrame *i420 = frame_format_i420(&ff, frame);
+
+                if (i420) {
+                    yuv_rgb_convert(&rgb, i420->data[0], i420->linesize[0],
+                        i420->data[1], i420->linesize[1],
+                        i420->data[2], i420->linesize[2],
+                        i420->width, i420->height);
+                }
+                else {
+                    /* nothing */
+                }
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_UpdateWindowSurface(window);
             }
             else {
-                /* decode error, skip frame */
+                /* Update texture with YUV data */
+                /* A pooled texture is full size: one that gets scaled
+                 * down is left locked for the pool to recycle */
+                TextureSlot *slot = frame_format_scales(&ff, frame->width,
+                    frame->height) ? NULL : texture_pool_slot(&pool, frame);
+                SDL_Texture *shown = NULL;
+                SDL_Rect src = { 0, 0, frame->width, frame->height };
+
+                if (slot) {
+                    /* Decoded in place: unlocking uploads it */
+                    shown = texture_pool_present(slot);
+                }
+                else {
+                    shown = frame_format_upload(&ff, frame);
+                }
+                t = metrics_end(&metrics, METRICS_UPLOAD, t);
+
+                SDL_RenderClear(renderer);
+                if (shown) {
+                    /* Pooled textures are padded past the frame */
+                    SDL_RenderCopy(renderer, shown, slot ? &src : NULL,
+                        NULL);
+                }
+                else {
+                    /* nothing */
+                }
+                SDL_RenderPresent(renderer);
+            }
+            metrics_end(&metrics, METRICS_PRESENT, t);
+            metrics_frame(&metrics);
+
+            if (!metrics.bench) {
+                schedule_presented(&sched, pts);
+            }
+            else {
+                /* nothing */
             }
+            position = pts;
+
+            /* Seek latency: key press to the target frame on screen */
+            if (seek_start) {
+                printf("Seek to %.3f s: %.1f ms\n", position,
+                    (double)(SDL_GetPerformanceCounter() - seek_start) *
+                        1000.0 / SDL_GetPerformanceFrequency());
+                seek_start = 0;
+            }
+            else {
+                /* nothing */
+            }
+
+            frame_queue_next(&dec.queue);
+        }
+        else if (frame) {
+            /* Sleep until the frame is due, waking for events */
+            schedule_wait(&sched, pts, 10);
         }
         else {
-            /* not video packet */
+            /* Decoder has not caught up yet */
+            SDL_Delay(1);
         }
 
-        av_packet_unref(packet);
+        /* Hand textures the decoder is done with back to it */
+        texture_pool_recycle(&pool);
+
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
 
         /* Handle events */
         while (SDL_PollEvent(&event)) {
@@ -187,6 +502,37 @@ int main(void)
                      event.key.keysym.sym == SDLK_ESCAPE) {
                 quit = 1;
             }
+            else if (event.type == SDL_WINDOWEVENT &&
+                     event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED &&
+                     renderer) {
+                /* The next upload reallocates the texture to fit */
+                SDL_GetRendererOutputSize(renderer, &out_width,
+                    &out_height);
+                frame_format_set_output(&ff, out_width, out_height);
+            }
+            else if (event.type == SDL_KEYDOWN &&
+                     (event.key.keysym.sym == SDLK_LEFT ||
+                      event.key.keysym.sym == SDLK_RIGHT ||
+                      event.key.keysym.sym == SDLK_DOWN ||
+                      event.key.keysym.sym == SDLK_UP ||
+                      event.key.keysym.sym == SDLK_HOME)) {
+                SDL_Keycode sym = event.key.keysym.sym;
+                double target = sym == SDLK_LEFT ? position - SEEK_SHORT :
+                    sym == SDLK_RIGHT ? position + SEEK_SHORT :
+                    sym == SDLK_DOWN ? position - SEEK_LONG :
+                    sym == SDLK_UP ? position + SEEK_LONG : 0.0;
+
+                /* Left/Right 5 s, Down/Up 60 s, Home to the start */
+                seek_start = SDL_GetPerformanceCounter();
+                seeks++;
+                thread = decode_seek(&dec, thread, target);
+                if (!thread) {
+                    quit = 1;
+                }
+                else {
+                    schedule_reset(&sched);
+                }
+            }
             else {
                 /* ignore other events */
             }
@@ -196,34 +542,51 @@ int main(void)
     ret = 0;
 
 cleanup:
-    if (packet) {
-        av_packet_free(&packet);
+    if (thread) {
+        frame_queue_abort(&dec.queue);
+        SDL_WaitThread(thread, NULL);
+    }
+    else {
+        /* nothing */
+    }
+
+    if (ret == 0 && seeks > 0) {
+        printf("Seeks: %d, %d frames decoded but not shown\n", seeks,
+            dec.frames_skipped);
     }
     else {
         /* nothing */
     }
 
-    if (frame) {
-        av_frame_free(&frame);
+    if (ret == 0 && !metrics.bench) {
+        schedule_report(&sched);
     }
     else {
         /* nothing */
     }
 
-    if (sws_ctx) {
-        sws_freeContext(sws_ctx);
+    if (ret == 0) {
+        metrics_report(&metrics);
     }
     else {
         /* nothing */
     }
 
-    if (texture) {
-        SDL_DestroyTexture(texture);
+    frame_queue_destroy(&dec.queue);
+    kf_index_free(&dec.index);
+
+    if (pool.count > 0) {
+        printf("Zero-copy decode: %d frames copied instead\n",
+            SDL_AtomicGet(&pool.misses));
     }
     else {
         /* nothing */
     }
 
+    texture_pool_destroy(&pool);
+
+    frame_format_destroy(&ff);
+
     if (renderer) {
         SDL_DestroyRenderer(renderer);
     }
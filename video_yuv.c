@@ -1,43 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <SDL2/SDL.h>
+#include "frame_source.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "schedule.h"
+#include "yuv_rgb.h"
 
 #define VIDEO_FILE "video.yuv"
 #define WIDTH      640
 #define HEIGHT     480
 #define FPS        30
 
-int main(void)
+int main(int argc, char **argv)
 {
-    FILE *fp = NULL;
+    FrameSource src;
+    Metrics metrics;
+    Prefetch prefetch;
+    YuvRgb rgb;
+    Schedule sched;
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
     SDL_Texture *texture = NULL;
-    unsigned char *y_plane = NULL;
-    unsigned char *u_plane = NULL;
-    unsigned char *v_plane = NULL;
+    const unsigned char *y_plane = NULL;
+    const unsigned char *u_plane = NULL;
+    const unsigned char *v_plane = NULL;
+    const char *path = argc > 1 ? argv[1] : VIDEO_FILE;
     int ret = 1;
 
-    /* Calculate plane sizes */
-    int y_size = WIDTH * HEIGHT;
-    int uv_size = (WIDTH / 2) * (HEIGHT / 2);
+    SDL_memset(&prefetch, 0, sizeof(prefetch));
+    metrics_init(&metrics, "video_yuv");
 
-    /* Open video file */
-    fp = fopen(VIDEO_FILE, "rb");
-    if (!fp) {
-        fprintf(stderr, "Could not open %s\n", VIDEO_FILE);
+    /* Map video file; a Y4M header overrides the built-in geometry */
+    if (frame_source_open(&src, path, WIDTH, HEIGHT, FPS) < 0) {
         return 1;
     }
     else {
         /* nothing */
     }
 
-    /* Allocate plane buffers */
-    y_plane = malloc(y_size);
-    u_plane = malloc(uv_size);
-    v_plane = malloc(uv_size);
-    if (!y_plane || !u_plane || !v_plane) {
-        fprintf(stderr, "Could not allocate buffers\n");
+    /* Fault frames in ahead of the playhead on an I/O thread */
+    if (prefetch_start(&prefetch, &src, NULL, NULL) < 0) {
         goto cleanup;
     }
     else {
@@ -55,7 +58,7 @@ int main(void)
 
     window = SDL_CreateWindow("Video Player",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WIDTH, HEIGHT, 0);
+        src.width, src.height, 0);
     if (!window) {
         fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
         goto cleanup;
@@ -64,51 +67,99 @@ int main(void)
         /* nothing */
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (!renderer) {
-        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
-        goto cleanup;
-    }
-    else {
+    /* YUV_RGB converts into the window surface, which rules out a
+     * renderer on the same window */
+    if (yuv_rgb_init(&rgb, window, src.height)) {
         /* nothing */
     }
-
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
-        SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
-    if (!texture) {
-        fprintf(stderr, "Could not create texture: %s\n", SDL_GetError());
-        goto cleanup;
-    }
     else {
-        /* nothing */
+        renderer = SDL_CreateRenderer(window, -1,
+            SDL_RENDERER_ACCELERATED | schedule_vsync_flag());
+        if (!renderer) {
+            fprintf(stderr, "Could not create renderer: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
+
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12,
+            SDL_TEXTUREACCESS_STREAMING, src.width, src.height);
+        if (!texture) {
+            fprintf(stderr, "Could not create texture: %s\n",
+                SDL_GetError());
+            goto cleanup;
+        }
+        else {
+            /* nothing */
+        }
     }
 
+    schedule_init(&sched, window, renderer ? schedule_vsync_flag() : 0);
+
     /* Main loop */
     SDL_Event event;
     int quit = 0;
-    int frame_delay_ms = 1000 / FPS;
+    long frame_num = 0;
 
     while (!quit) {
-        /* Read one frame (Y, then U, then V) */
-        if (fread(y_plane, 1, y_size, fp) != (size_t)y_size ||
-            fread(u_plane, 1, uv_size, fp) != (size_t)uv_size ||
-            fread(v_plane, 1, uv_size, fp) != (size_t)uv_size) {
+        /* Exact in the stream's own rate, so 30000/1001 does not drift */
+        double pts = (double)frame_num * src.fps_den / src.fps_num;
+        Uint64 t = metrics_begin();
+
+        /* Point at the next frame (Y, then U, then V) in the mapping */
+        if (prefetch_get(&prefetch, frame_num, &y_plane, &u_plane,
+                &v_plane) < 0) {
             break;
         }
         else {
-            /* nothing */
+            frame_num++;
         }
+        t = metrics_end(&metrics, METRICS_READ, t);
 
-        /* Update texture with YUV data */
-        SDL_UpdateYUVTexture(texture, NULL,
-            y_plane, WIDTH,
-            u_plane, WIDTH / 2,
-            v_plane, WIDTH / 2);
+        if (rgb.window) {
+            /* Convert into the window surface */
+            yuv_rgb_convert(&rgb, y_plane, src.width,
+                u_plane, src.chroma_width, v_plane, src.chroma_width,
+                src.width, src.height);
+        }
+        else {
+            /* Update texture with YUV data */
+            SDL_UpdateYUVTexture(texture, NULL,
+                y_plane, src.width,
+                u_plane, src.chroma_width,
+                v_plane, src.chroma_width);
+        }
+        metrics_end(&metrics, METRICS_UPLOAD, t);
 
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
-        SDL_Delay(frame_delay_ms);
+        /* Uploaded ahead: only the present waits for the deadline. Bench
+         * mode shows frames as fast as they can be drawn */
+        while (!metrics.bench && schedule_due(&sched, pts) > 0.0) {
+            schedule_wait(&sched, pts, 10);
+        }
+
+        t = metrics_begin();
+        if (rgb.window) {
+            SDL_UpdateWindowSurface(window);
+        }
+        else {
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            SDL_RenderPresent(renderer);
+        }
+        metrics_end(&metrics, METRICS_PRESENT, t);
+        metrics_frame(&metrics);
+
+        if (!metrics.bench) {
+            schedule_presented(&sched, pts);
+        }
+        else {
+            /* nothing */
+        }
+
+        /* Write the metrics file if SIGUSR1 asked for it */
+        metrics_poll(&metrics);
 
         /* Handle events */
         while (SDL_PollEvent(&event)) {
@@ -125,30 +176,18 @@ int main(void)
         }
     }
 
-    ret = 0;
-
-cleanup:
-    if (y_plane) {
-        free(y_plane);
+    prefetch_report(&prefetch);
+    if (!metrics.bench) {
+        schedule_report(&sched);
     }
     else {
         /* nothing */
     }
+    metrics_report(&metrics);
 
-    if (u_plane) {
-        free(u_plane);
-    }
-    else {
-        /* nothing */
-    }
-
-    if (v_plane) {
-        free(v_plane);
-    }
-    else {
-        /* nothing */
-    }
+    ret = 0;
 
+cleanup:
     if (texture) {
         SDL_DestroyTexture(texture);
     }
@@ -172,12 +211,8 @@ cleanup:
 
     SDL_Quit();
 
-    if (fp) {
-        fclose(fp);
-    }
-    else {
-        /* nothing */
-    }
+    prefetch_stop(&prefetch);
+    frame_source_close(&src);
 
     return ret;
 }
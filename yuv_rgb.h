@@ -0,0 +1,494 @@
+#ifndef YUV_RGB_H
+#define YUV_RGB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_RGB_X86  1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_RGB_NEON  1
+#endif
+
+/* Fractional bits of the fixed-point coefficients */
+#define YUV_RGB_BITS  13
+
+/*
+ * I420 to 32-bit RGB straight into the window surface, for software
+ * rendering where SDL's own YV12 texture path does a scalar conversion
+ * per frame:
+ *   YUV_RGB  unset or 0 = textures as before, 1 or auto = fastest kernel,
+ *            or force one of scalar, sse4, avx2, neon
+ * All kernels use the same integer arithmetic, so every SIMD kernel must
+ * match the scalar reference bit for bit; yuv_rgb_init checks that on a
+ * test pattern before using one. Chroma is upsampled by repetition and
+ * the frame is cropped, not scaled, to the window.
+ */
+typedef struct {
+    int y_offset;
+    int y;
+    int rv;
+    int gu;
+    int gv;
+    int bu;
+    int rshift;
+    int gshift;
+    int bshift;
+    Uint32 alpha;
+} YuvRgbCoeffs;
+
+typedef void (*YuvRgbRow)(const Uint8 *y, const Uint8 *u, const Uint8 *v,
+    Uint32 *dst, int width, const YuvRgbCoeffs *k);
+
+typedef struct {
+    SDL_Window *window;
+    YuvRgbRow row;
+    const char *kernel;
+    Uint32 format;
+    int matrix;
+    int full_range;
+    YuvRgbCoeffs k;
+} YuvRgb;
+
+static Uint32 yuv_rgb_pixel(int y, int u, int v, const YuvRgbCoeffs *k)
+{
+    int c = (y - k->y_offset) * k->y + (1 << (YUV_RGB_BITS - 1));
+    int d = u - 128;
+    int e = v - 128;
+    int r = (c + k->rv * e) >> YUV_RGB_BITS;
+    int g = (c - (k->gu * d + k->gv * e)) >> YUV_RGB_BITS;
+    int b = (c + k->bu * d) >> YUV_RGB_BITS;
+
+    r = r < 0 ? 0 : r > 255 ? 255 : r;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    b = b < 0 ? 0 : b > 255 ? 255 : b;
+
+    return ((Uint32)r << k->rshift) | ((Uint32)g << k->gshift) |
+        ((Uint32)b << k->bshift) | k->alpha;
+}
+
+/* Scalar reference, from pixel 'x' (even) to the end of the row */
+static void yuv_rgb_row_tail(const Uint8 *y, const Uint8 *u,
+    const Uint8 *v, Uint32 *dst, int x, int width, const YuvRgbCoeffs *k)
+{
+    for (; x < width; x++) {
+        dst[x] = yuv_rgb_pixel(y[x], u[x / 2], v[x / 2], k);
+    }
+}
+
+static void yuv_rgb_row_scalar(const Uint8 *y, const Uint8 *u,
+    const Uint8 *v, Uint32 *dst, int width, const YuvRgbCoeffs *k)
+{
+    yuv_rgb_row_tail(y, u, v, dst, 0, width, k);
+}
+
+#ifdef YUV_RGB_X86
+
+/* Four pixels per step, 32-bit lanes */
+__attribute__((target("sse4.1")))
+static void yuv_rgb_row_sse4(const Uint8 *y, const Uint8 *u,
+    const Uint8 *v, Uint32 *dst, int width, const YuvRgbCoeffs *k)
+{
+    const __m128i y_offset = _mm_set1_epi32(k->y_offset);
+    const __m128i cy = _mm_set1_epi32(k->y);
+    const __m128i crv = _mm_set1_epi32(k->rv);
+    const __m128i cgu = _mm_set1_epi32(k->gu);
+    const __m128i cgv = _mm_set1_epi32(k->gv);
+    const __m128i cbu = _mm_set1_epi32(k->bu);
+    const __m128i round = _mm_set1_epi32(1 << (YUV_RGB_BITS - 1));
+    const __m128i c128 = _mm_set1_epi32(128);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi32(255);
+    const __m128i alpha = _mm_set1_epi32((int)k->alpha);
+    const __m128i rs = _mm_cvtsi32_si128(k->rshift);
+    const __m128i gs = _mm_cvtsi32_si128(k->gshift);
+    const __m128i bs = _mm_cvtsi32_si128(k->bshift);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        Uint32 y4;
+        Uint16 u2;
+        Uint16 v2;
+
+        memcpy(&y4, y + x, 4);
+        memcpy(&u2, u + x / 2, 2);
+        memcpy(&v2, v + x / 2, 2);
+
+        __m128i yy = _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)y4));
+        __m128i uu = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(u2));
+        __m128i vv = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v2));
+
+        /* u0 u1 -> u0 u0 u1 u1 */
+        uu = _mm_sub_epi32(_mm_unpacklo_epi32(uu, uu), c128);
+        vv = _mm_sub_epi32(_mm_unpacklo_epi32(vv, vv), c128);
+
+        __m128i c = _mm_add_epi32(
+            _mm_mullo_epi32(_mm_sub_epi32(yy, y_offset), cy), round);
+        __m128i r = _mm_srai_epi32(
+            _mm_add_epi32(c, _mm_mullo_epi32(vv, crv)), YUV_RGB_BITS);
+        __m128i g = _mm_srai_epi32(
+            _mm_sub_epi32(c, _mm_add_epi32(_mm_mullo_epi32(uu, cgu),
+                _mm_mullo_epi32(vv, cgv))), YUV_RGB_BITS);
+        __m128i b = _mm_srai_epi32(
+            _mm_add_epi32(c, _mm_mullo_epi32(uu, cbu)), YUV_RGB_BITS);
+
+        r = _mm_min_epi32(_mm_max_epi32(r, zero), c255);
+        g = _mm_min_epi32(_mm_max_epi32(g, zero), c255);
+        b = _mm_min_epi32(_mm_max_epi32(b, zero), c255);
+
+        __m128i px = _mm_or_si128(
+            _mm_or_si128(_mm_sll_epi32(r, rs), _mm_sll_epi32(g, gs)),
+            _mm_or_si128(_mm_sll_epi32(b, bs), alpha));
+        _mm_storeu_si128((__m128i *)(dst + x), px);
+    }
+
+    yuv_rgb_row_tail(y, u, v, dst, x, width, k);
+}
+
+/* Eight pixels per step, 32-bit lanes */
+__attribute__((target("avx2")))
+static void yuv_rgb_row_avx2(const Uint8 *y, const Uint8 *u,
+    const Uint8 *v, Uint32 *dst, int width, const YuvRgbCoeffs *k)
+{
+    const __m256i y_offset = _mm256_set1_epi32(k->y_offset);
+    const __m256i cy = _mm256_set1_epi32(k->y);
+    const __m256i crv = _mm256_set1_epi32(k->rv);
+    const __m256i cgu = _mm256_set1_epi32(k->gu);
+    const __m256i cgv = _mm256_set1_epi32(k->gv);
+    const __m256i cbu = _mm256_set1_epi32(k->bu);
+    const __m256i round = _mm256_set1_epi32(1 << (YUV_RGB_BITS - 1));
+    const __m256i c128 = _mm256_set1_epi32(128);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi32(255);
+    const __m256i alpha = _mm256_set1_epi32((int)k->alpha);
+    const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m128i rs = _mm_cvtsi32_si128(k->rshift);
+    const __m128i gs = _mm_cvtsi32_si128(k->gshift);
+    const __m128i bs = _mm_cvtsi32_si128(k->bshift);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        Uint32 u4;
+        Uint32 v4;
+
+        memcpy(&u4, u + x / 2, 4);
+        memcpy(&v4, v + x / 2, 4);
+
+        __m256i yy = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(y + x)));
+        __m256i uu = _mm256_cvtepu8_epi32(_mm_cvtsi32_si128((int)u4));
+        __m256i vv = _mm256_cvtepu8_epi32(_mm_cvtsi32_si128((int)v4));
+
+        /* u0 u1 u2 u3 -> u0 u0 u1 u1 u2 u2 u3 u3 */
+        uu = _mm256_sub_epi32(_mm256_permutevar8x32_epi32(uu, pairs), c128);
+        vv = _mm256_sub_epi32(_mm256_permutevar8x32_epi32(vv, pairs), c128);
+
+        __m256i c = _mm256_add_epi32(
+            _mm256_mullo_epi32(_mm256_sub_epi32(yy, y_offset), cy), round);
+        __m256i r = _mm256_srai_epi32(
+            _mm256_add_epi32(c, _mm256_mullo_epi32(vv, crv)), YUV_RGB_BITS);
+        __m256i g = _mm256_srai_epi32(
+            _mm256_sub_epi32(c, _mm256_add_epi32(
+                _mm256_mullo_epi32(uu, cgu), _mm256_mullo_epi32(vv, cgv))),
+            YUV_RGB_BITS);
+        __m256i b = _mm256_srai_epi32(
+            _mm256_add_epi32(c, _mm256_mullo_epi32(uu, cbu)), YUV_RGB_BITS);
+
+        r = _mm256_min_epi32(_mm256_max_epi32(r, zero), c255);
+        g = _mm256_min_epi32(_mm256_max_epi32(g, zero), c255);
+        b = _mm256_min_epi32(_mm256_max_epi32(b, zero), c255);
+
+        __m256i px = _mm256_or_si256(
+            _mm256_or_si256(_mm256_sll_epi32(r, rs), _mm256_sll_epi32(g, gs)),
+            _mm256_or_si256(_mm256_sll_epi32(b, bs), alpha));
+        _mm256_storeu_si256((__m256i *)(dst + x), px);
+    }
+
+    yuv_rgb_row_tail(y, u, v, dst, x, width, k);
+}
+
+#endif
+
+#ifdef YUV_RGB_NEON
+
+/* Four pixels of the eight a NEON step converts */
+static inline uint32x4_t yuv_rgb_neon4(int32x4_t yy, int32x4_t uu,
+    int32x4_t vv, const YuvRgbCoeffs *k)
+{
+    const int32x4_t zero = vdupq_n_s32(0);
+    const int32x4_t c255 = vdupq_n_s32(255);
+    int32x4_t c = vaddq_s32(
+        vmulq_n_s32(vsubq_s32(yy, vdupq_n_s32(k->y_offset)), k->y),
+        vdupq_n_s32(1 << (YUV_RGB_BITS - 1)));
+    int32x4_t r = vshrq_n_s32(vaddq_s32(c, vmulq_n_s32(vv, k->rv)),
+        YUV_RGB_BITS);
+    int32x4_t g = vshrq_n_s32(vsubq_s32(c, vaddq_s32(vmulq_n_s32(uu, k->gu),
+        vmulq_n_s32(vv, k->gv))), YUV_RGB_BITS);
+    int32x4_t b = vshrq_n_s32(vaddq_s32(c, vmulq_n_s32(uu, k->bu)),
+        YUV_RGB_BITS);
+
+    r = vminq_s32(vmaxq_s32(r, zero), c255);
+    g = vminq_s32(vmaxq_s32(g, zero), c255);
+    b = vminq_s32(vmaxq_s32(b, zero), c255);
+
+    return vorrq_u32(
+        vorrq_u32(
+            vshlq_u32(vreinterpretq_u32_s32(r), vdupq_n_s32(k->rshift)),
+            vshlq_u32(vreinterpretq_u32_s32(g), vdupq_n_s32(k->gshift))),
+        vorrq_u32(
+            vshlq_u32(vreinterpretq_u32_s32(b), vdupq_n_s32(k->bshift)),
+            vdupq_n_u32(k->alpha)));
+}
+
+/* Eight pixels per step */
+static void yuv_rgb_row_neon(const Uint8 *y, const Uint8 *u,
+    const Uint8 *v, Uint32 *dst, int width, const YuvRgbCoeffs *k)
+{
+    const int16x8_t c128 = vdupq_n_s16(128);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        Uint32 u4;
+        Uint32 v4;
+
+        memcpy(&u4, u + x / 2, 4);
+        memcpy(&v4, v + x / 2, 4);
+
+        /* u0 u1 u2 u3 -> u0 u0 u1 u1 u2 u2 u3 u3 */
+        uint8x8_t u8 = vreinterpret_u8_u32(vdup_n_u32(u4));
+        uint8x8_t v8 = vreinterpret_u8_u32(vdup_n_u32(v4));
+        u8 = vzip_u8(u8, u8).val[0];
+        v8 = vzip_u8(v8, v8).val[0];
+
+        int16x8_t yy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x)));
+        int16x8_t uu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), c128);
+        int16x8_t vv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), c128);
+
+        vst1q_u32(dst + x, yuv_rgb_neon4(vmovl_s16(vget_low_s16(yy)),
+            vmovl_s16(vget_low_s16(uu)), vmovl_s16(vget_low_s16(vv)), k));
+        vst1q_u32(dst + x + 4, yuv_rgb_neon4(vmovl_s16(vget_high_s16(yy)),
+            vmovl_s16(vget_high_s16(uu)), vmovl_s16(vget_high_s16(vv)), k));
+    }
+
+    yuv_rgb_row_tail(y, u, v, dst, x, width, k);
+}
+
+#endif
+
+/* BT.601 or BT.709, limited (16-235) or full range, in fixed point */
+static void yuv_rgb_set_matrix(YuvRgb *c, int matrix, int full_range)
+{
+    double kr = matrix == 709 ? 0.2126 : 0.299;
+    double kb = matrix == 709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ys = full_range ? 1.0 : 255.0 / 219.0;
+    double cs = (full_range ? 1.0 : 255.0 / 224.0) * (1 << YUV_RGB_BITS);
+
+    c->matrix = matrix;
+    c->full_range = full_range;
+    c->k.y_offset = full_range ? 0 : 16;
+    c->k.y = (int)(ys * (1 << YUV_RGB_BITS) + 0.5);
+    c->k.rv = (int)(2.0 * (1.0 - kr) * cs + 0.5);
+    c->k.gu = (int)(2.0 * (1.0 - kb) * kb / kg * cs + 0.5);
+    c->k.gv = (int)(2.0 * (1.0 - kr) * kr / kg * cs + 0.5);
+    c->k.bu = (int)(2.0 * (1.0 - kb) * cs + 0.5);
+}
+
+/* Pack for the surface's channel order; 0 if it is not 8-bit x 4 */
+static int yuv_rgb_set_format(YuvRgb *c, const SDL_PixelFormat *fmt)
+{
+    if (fmt->BytesPerPixel != 4 ||
+        fmt->Rmask >> fmt->Rshift != 0xFF ||
+        fmt->Gmask >> fmt->Gshift != 0xFF ||
+        fmt->Bmask >> fmt->Bshift != 0xFF) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    c->format = fmt->format;
+    c->k.rshift = fmt->Rshift;
+    c->k.gshift = fmt->Gshift;
+    c->k.bshift = fmt->Bshift;
+    c->k.alpha = fmt->Amask;
+
+    return 1;
+}
+
+/* Compare 'row' with the scalar reference over every chroma value and a
+ * spread of luma, including a tail shorter than one SIMD step */
+static int yuv_rgb_selftest(YuvRgbRow row, const YuvRgbCoeffs *k)
+{
+    enum { W = 77 };
+    Uint8 y[W];
+    Uint8 u[(W + 1) / 2];
+    Uint8 v[(W + 1) / 2];
+    Uint32 want[W];
+    Uint32 got[W];
+
+    for (int pass = 0; pass < 256; pass++) {
+        for (int i = 0; i < W; i++) {
+            y[i] = (Uint8)(i * 89 + pass * 7);
+        }
+        for (int i = 0; i < (W + 1) / 2; i++) {
+            u[i] = (Uint8)(pass + i * 5);
+            v[i] = (Uint8)(255 - pass + i * 3);
+        }
+
+        yuv_rgb_row_scalar(y, u, v, want, W, k);
+        row(y, u, v, got, W, k);
+        if (memcmp(want, got, sizeof(want)) != 0) {
+            return 0;
+        }
+        else {
+            /* nothing */
+        }
+    }
+
+    return 1;
+}
+
+/* Fastest kernel this CPU runs, or the one YUV_RGB names */
+static void yuv_rgb_pick(YuvRgb *c, const char *want)
+{
+    int any = strcmp(want, "1") == 0 || strcmp(want, "auto") == 0;
+
+    c->row = yuv_rgb_row_scalar;
+    c->kernel = "scalar";
+
+#ifdef YUV_RGB_X86
+    if ((any || strcmp(want, "avx2") == 0) && SDL_HasAVX2()) {
+        c->row = yuv_rgb_row_avx2;
+        c->kernel = "avx2";
+    }
+    else if ((any || strcmp(want, "sse4") == 0) && SDL_HasSSE41()) {
+        c->row = yuv_rgb_row_sse4;
+        c->kernel = "sse4";
+    }
+    else {
+        /* nothing */
+    }
+#endif
+
+#ifdef YUV_RGB_NEON
+    if ((any || strcmp(want, "neon") == 0) && SDL_HasNEON()) {
+        c->row = yuv_rgb_row_neon;
+        c->kernel = "neon";
+    }
+    else {
+        /* nothing */
+    }
+#endif
+
+    if (!any && strcmp(want, c->kernel) != 0) {
+        fprintf(stderr, "YUV_RGB=%s not available here, using %s\n", want,
+            c->kernel);
+    }
+    else {
+        /* nothing */
+    }
+}
+
+/* 1 if frames go through the window surface, 0 to keep using textures.
+ * 'height' picks the default matrix: BT.709 from 720 lines up. */
+static int yuv_rgb_init(YuvRgb *c, SDL_Window *window, int height)
+{
+    const char *env = getenv("YUV_RGB");
+    SDL_Surface *surface;
+
+    SDL_memset(c, 0, sizeof(*c));
+
+    if (!env || !env[0] || strcmp(env, "0") == 0) {
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    surface = SDL_GetWindowSurface(window);
+    if (!surface || !yuv_rgb_set_format(c, surface->format)) {
+        fprintf(stderr, "YUV_RGB: unsupported window surface, "
+            "using textures\n");
+        return 0;
+    }
+    else {
+        /* nothing */
+    }
+
+    c->window = window;
+    yuv_rgb_set_matrix(c, height >= 720 ? 709 : 601, 0);
+    yuv_rgb_pick(c, env);
+
+    if (c->row != yuv_rgb_row_scalar && !yuv_rgb_selftest(c->row, &c->k)) {
+        fprintf(stderr, "YUV_RGB: %s kernel does not match the scalar "
+            "reference, using scalar\n", c->kernel);
+        c->row = yuv_rgb_row_scalar;
+        c->kernel = "scalar";
+    }
+    else {
+        /* nothing */
+    }
+
+    printf("YUV->RGB: %s kernel, BT.%d into %s surface\n", c->kernel,
+        c->matrix, SDL_GetPixelFormatName(c->format));
+
+    return 1;
+}
+
+/* Convert one I420 frame into the window surface; the caller then calls
+ * SDL_UpdateWindowSurface. -1 without a frame or a usable surface. */
+static int yuv_rgb_convert(YuvRgb *c,
+    const Uint8 *y, int y_pitch, const Uint8 *u, int u_pitch,
+    const Uint8 *v, int v_pitch, int width, int height)
+{
+    SDL_Surface *surface = y ? SDL_GetWindowSurface(c->window) : NULL;
+
+    if (!surface) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    /* A resize can hand out a surface in another layout */
+    if (surface->format->format != c->format &&
+        !yuv_rgb_set_format(c, surface->format)) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0) {
+        return -1;
+    }
+    else {
+        /* nothing */
+    }
+
+    int w = width < surface->w ? width : surface->w;
+    int h = height < surface->h ? height : surface->h;
+
+    for (int j = 0; j < h; j++) {
+        c->row(y + (size_t)j * y_pitch, u + (size_t)(j / 2) * u_pitch,
+            v + (size_t)(j / 2) * v_pitch,
+            (Uint32 *)((Uint8 *)surface->pixels + (size_t)j * surface->pitch),
+            w, &c->k);
+    }
+
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+    else {
+        /* nothing */
+    }
+
+    return 0;
+}
+
+#endif